@@ -41,11 +41,43 @@ SOFTWARE.
 #include <cctype>
 #include <algorithm>
 #include <deque>
+#include <iterator>
 #include <cstdio> // Important to allow the user to delete a file.
 #include <sys/stat.h> // Being used for the file size of the document.
 #include <iomanip> 
-#include <signal.h> 
+#include <signal.h>
 #include <unistd.h>
+#include <fcntl.h> // Used for the low level file writing when saving and replacing.
+#include <atomic>
+#include <mutex>
+#include <functional>
+#include <cerrno>
+#include <climits>
+#include <chrono>
+#include <sys/uio.h> // writev, so a save is a few big writes instead of one per line.
+#include <memory>
+#include <set>
+#include <cstdint>
+#include <condition_variable>
+#include <sys/inotify.h> // Noticing when another program changes the open file.
+#include <sys/file.h> // flock, so two NemoS can't share a swap file.
+#include <sys/mman.h> // --view maps the file instead of reading it.
+#include <zlib.h> // Opening and saving .gz files.
+#include <dlfcn.h> // libzstd is loaded only when a .zst file is opened.
+#include <sys/wait.h>
+#include <poll.h> // Clipboard programs get a time limit.
+#include <sys/eventfd.h>
+#include <sys/epoll.h> // The editor sleeps in one place until there is something to do.
+#include <sys/timerfd.h>
+#include <sys/signalfd.h>
+#include <sys/ioctl.h>
+#include <array>
+#include <map>
+#include <coroutine> // Prompts wait for keys without a loop of their own.
+#include <optional>
+#include <utility>
+#include <string_view>
+#include <random>
 bool isSafePath(const std::string& path);
 enum FilePermission{
     READABLE =0,
@@ -90,25 +122,27 @@ bool isFileWriteable(const std::string& filename) {
     return checkPermission(".", WRITEABLE);
 }
 
+std::string formatSize(double size) {
+    std::ostringstream oss;
+    oss << std::fixed << std::setprecision(1);
+    if (size < 1024) {
+        oss << size << " B";
+    } else if (size < 1024 * 1024) {
+        oss << size / 1024 << " KB";
+    } else if (size < 1024 * 1024 * 1024) {
+        oss << size / (1024 * 1024) << " MB";
+    } else {
+        oss << size / (1024 * 1024 * 1024) << " GB";
+    }
+    return oss.str();
+}
+
 std::string getFileSize(const std::string &filename){ // Calcuction to find the file size. 
         struct stat stat_buf;
         int rc = stat(filename.c_str(), &stat_buf);
         if (rc == 0) {
-            double size = stat_buf.st_size;
-            std::ostringstream oss;
-            oss << std::fixed << std::setprecision(1);
-
-        if (size < 1024) {
-            oss << size << " B";
-        } else if (size < 1024 * 1024) {
-            oss << size / 1024 << " KB";
-        } else if (size < 1024 * 1024 * 1024) {
-            oss << size / (1024 * 1024) << " MB";
-        } else {
-            oss << size / (1024 * 1024 * 1024) << " GB";
+            return formatSize(stat_buf.st_size);
         }
-        return oss.str(); 
-    }
         return "0 B"; // Return 0 B if the file doesn't exist or can't be accessed
 }
 
@@ -119,6 +153,16 @@ void helpCommand(){
     << "nemos                      Will create or use untitled.txt document\n"
     << "nemos file.txt             Will create or use the file.txt\n"
     << "nemos --delete file.txt    Will delete the file that is given\n"
+    << "nemos --replace OLD NEW files...\n"
+    << "                           Will replace OLD with NEW in every file given\n"
+    << "nemos --replace --dry-run OLD NEW files...\n"
+    << "                           Will show what would be replaced without writing\n"
+    << "cmd | nemos -              Read what cmd prints into a new document as it arrives\n"
+    << "nemos --view file.log      Page through a file read only, without loading it\n"
+    << "nemos --follow file.log    Open the file and keep reading new lines, like tail -f\n"
+    << "nemos --bench-save [MB]    Time saving a large document (256 MB by default)\n"
+    << "nemos --self-test-snapshots [seconds]\n"
+    << "                           Stress test the text snapshots (10 seconds by default)\n"
     << "nemos --version            Show what version of Nemos is installed\n"
     << "nemos --license            Show the software license\n"
     << "man nemos                  Will display man page for Nemos \n"    
@@ -191,94 +235,4322 @@ int DeleteFile(int argc, char *argv[], int i) {
     return 0;
 }
 
+// Writes the whole buffer to fd, carrying on after short writes and signals.
+bool writeAll(int fd, const char *data, size_t size) {
+    while (size > 0) {
+        ssize_t written = write(fd, data, size);
+        if (written < 0) {
+            if (errno == EINTR) continue;
+            return false;
+        }
+        data += written;
+        size -= written;
+    }
+    return true;
+}
+
+// Writes go through symlinks to the real file instead of replacing the link.
+std::string resolveSymlinks(const std::string &filename) {
+    char resolved[PATH_MAX];
+    if (realpath(filename.c_str(), resolved)) {
+        return resolved;
+    }
+    return filename;
+}
 
+// Whole files are never rewritten in place. We write to a hidden temp file in
+// the same directory and rename it over the original once it is safely on the
+// disk, so a crash or a full disk half way through can't destroy the user's file.
+int openTempBeside(const std::string &target, std::string &tempPath) {
+    size_t last_slash = target.find_last_of('/');
+    std::string dir = (last_slash == std::string::npos) ? "" : target.substr(0, last_slash + 1);
+    std::string base = (last_slash == std::string::npos) ? target : target.substr(last_slash + 1);
+    tempPath = dir + "." + base + ".nemos-XXXXXX";
+    return mkostemp(&tempPath[0], O_CLOEXEC);
+}
 
-class NemoS {
+// Flushes the directory entry of path, so a new or renamed file survives a crash.
+void syncDirectoryOf(const std::string &path) {
+    size_t last_slash = path.find_last_of('/');
+    std::string dir = (last_slash == std::string::npos) ? "." : path.substr(0, last_slash);
+    if (dir.empty()) dir = "/";
+    int dirFd = open(dir.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (dirFd >= 0) {
+        fsync(dirFd);
+        close(dirFd);
+    }
+}
+
+// Gives the temp file the mode and owner of the file it replaces, flushes it and
+// renames it over the target. The temp file is removed if anything goes wrong.
+bool commitTemp(int fd, const std::string &tempPath, const std::string &target) {
+    struct stat original;
+    if (stat(target.c_str(), &original) == 0) {
+        fchmod(fd, original.st_mode & 07777);
+        if (fchown(fd, original.st_uid, original.st_gid) != 0) {
+            // Only root can hand the file to another user, the mode is still kept.
+        }
+    } else {
+        mode_t mask = umask(0);
+        umask(mask);
+        fchmod(fd, 0666 & ~mask); // New files get the normal permissions, not 0600.
+    }
+
+    if (fsync(fd) != 0) {
+        close(fd);
+        unlink(tempPath.c_str());
+        return false;
+    }
+    if (close(fd) != 0 || rename(tempPath.c_str(), target.c_str()) != 0) {
+        unlink(tempPath.c_str());
+        return false;
+    }
+
+    syncDirectoryOf(target); // Make the rename itself durable.
+    return true;
+}
+
+// Background work for the whole program: one worker per core, each with its
+// own deque of jobs. A worker takes its newest job first and, when it runs
+// dry, steals the oldest job of another worker, so a burst of jobs spreads out
+// by itself. Interactive jobs (something the user is waiting on) always go
+// before background ones (printing), wherever they are queued.
+class ThreadPool {
 public:
-    NemoS() {
-        initscr();             // Start ncurses
-        raw();                 // Disable line buffering
-        keypad(stdscr, TRUE);  // Enable special keys
-        noecho();              // Don't echo input
-        start_color();         // Enable colors
-        // Define pinkish color pairs
-        init_pair(1, COLOR_CYAN, COLOR_BLACK);   // Text in pink
-        init_pair(2, COLOR_BLACK, COLOR_MAGENTA); // Status bar
-        init_pair(3, COLOR_MAGENTA, COLOR_BLACK); // Help text
-        init_pair(4, COLOR_BLACK, COLOR_WHITE); //Highlighter...
+    enum Priority { INTERACTIVE, BACKGROUND };
+
+    // Set it to ask a job to stop early, the job checks it now and then.
+    using CancelToken = std::shared_ptr<std::atomic<bool>>;
+
+    static CancelToken newToken() {
+        return std::make_shared<std::atomic<bool>>(false);
     }
 
-    ~NemoS() {
-        endwin(); // End ncurses
+    // Started the first time it's needed. Threads started later inherit the
+    // signal mask of whoever asked first, the editor blocks its signals early.
+    static ThreadPool &shared() {
+        static ThreadPool pool(std::max(1u, std::thread::hardware_concurrency()));
+        return pool;
     }
 
-void run(std::string &filename) {
-    if (filename.empty()) {
-        filename = "untitled.txt";
-    } else if (!isSafePath(filename)) {
-        drawMessage("Error: Invalid file path! :(");
-        filename = "untitled.txt";
+    explicit ThreadPool(size_t count) {
+        for (size_t i = 0; i < count; i++) {
+            workers.push_back(std::make_unique<Worker>());
+        }
+        for (size_t i = 0; i < count; i++) {
+            threads.emplace_back(&ThreadPool::run, this, i);
+        }
     }
 
-    // Load the file (permission checks happen inside loadFile)
-    loadFile(filename);
-    
-    // Only warn about write permissions if file exists
-    if (checkPermission(filename, EXISTS) && !isFileWriteable(filename)) {
-        drawMessage("Error: No write permission - opening read-only! :(");
+    ~ThreadPool() {
+        {
+            std::lock_guard<std::mutex> lock(sleepMutex);
+            stopping = true;
+        }
+        jobAdded.notify_all();
+        for (auto &thread : threads) {
+            thread.join();
+        }
     }
 
-    drawEditor(filename);
-}
+    size_t size() const {
+        return workers.size();
+    }
+
+    void submit(std::function<void()> job, Priority priority = BACKGROUND) {
+        // A worker queues its own jobs at home, anyone else spreads them around.
+        size_t target = currentWorker >= 0 ? currentWorker : nextWorker++ % workers.size();
+        {
+            std::lock_guard<std::mutex> lock(workers[target]->mutex);
+            workers[target]->jobs[priority].push_back(std::move(job));
+        }
+        {
+            std::lock_guard<std::mutex> lock(sleepMutex);
+            queued++;
+        }
+        jobAdded.notify_one();
+    }
+
+    // Runs work(0) ... work(count - 1) on the pool and returns when all are
+    // done. The caller works along, so this is fine to call from a job too.
+    // Once cancel is set the indices not started yet are skipped.
+    void parallelFor(size_t count, const std::function<void(size_t)> &work,
+                     CancelToken cancel = nullptr, Priority priority = INTERACTIVE) {
+        struct Shared {
+            std::function<void(size_t)> work;
+            size_t count;
+            CancelToken cancel;
+            std::atomic<size_t> next{0};
+            size_t finished = 0;
+            std::mutex mutex;
+            std::condition_variable allDone;
+        };
+        auto shared = std::make_shared<Shared>();
+        shared->work = work;
+        shared->count = count;
+        shared->cancel = cancel;
+        auto help = [shared]() {
+            size_t did = 0;
+            for (size_t i = shared->next++; i < shared->count; i = shared->next++) {
+                if (!shared->cancel || !shared->cancel->load(std::memory_order_relaxed)) {
+                    shared->work(i);
+                }
+                did++;
+            }
+            if (did > 0) {
+                std::lock_guard<std::mutex> lock(shared->mutex);
+                shared->finished += did;
+                if (shared->finished == shared->count) {
+                    shared->allDone.notify_all();
+                }
+            }
+        };
+        size_t helpers = std::min(workers.size(), count) - (count > 0);
+        for (size_t i = 0; i < helpers; i++) {
+            submit(help, priority);
+        }
+        help();
+        std::unique_lock<std::mutex> lock(shared->mutex);
+        shared->allDone.wait(lock, [&shared]() { return shared->finished == shared->count; });
+    }
 
 private:
-    int viewX = 0, viewY = 0; // Tracks the visible area (scroll position)
+    struct Worker {
+        std::mutex mutex;
+        std::deque<std::function<void()>> jobs[2]; // By priority.
+    };
 
-    std::vector<std::string> content; // Stores the text file content
-    int cursorX = 0, cursorY = 0;     // Cursor position
-    std::stack<std::vector<std::string>> undoStack; // Undo stack
-    std::stack<std::vector<std::string>> redoStack; // Redo stack
-    std::deque<int> konamiSequence; //The easter egg. 
-    bool isModified = false; // Will  be used when the user tries to leave but may forget to save..
-void loadFile(const std::string &filename) {
-    // Clear existing content
-    content.clear();
-    
-    // Check if file exists first
+    bool takeJob(size_t self, std::function<void()> &job) {
+        for (int priority = INTERACTIVE; priority <= BACKGROUND; priority++) {
+            {
+                Worker &own = *workers[self];
+                std::lock_guard<std::mutex> lock(own.mutex);
+                if (!own.jobs[priority].empty()) {
+                    job = std::move(own.jobs[priority].back());
+                    own.jobs[priority].pop_back();
+                    return true;
+                }
+            }
+            for (size_t i = 1; i < workers.size(); i++) {
+                Worker &victim = *workers[(self + i) % workers.size()];
+                std::lock_guard<std::mutex> lock(victim.mutex);
+                if (!victim.jobs[priority].empty()) {
+                    job = std::move(victim.jobs[priority].front());
+                    victim.jobs[priority].pop_front();
+                    return true;
+                }
+            }
+        }
+        return false;
+    }
+
+    void run(size_t self) {
+        currentWorker = self;
+        while (true) {
+            {
+                std::unique_lock<std::mutex> lock(sleepMutex);
+                jobAdded.wait(lock, [this]() { return queued > 0 || stopping; });
+                if (queued == 0) {
+                    return; // Stopping, and nothing left to do.
+                }
+            }
+            std::function<void()> job;
+            if (takeJob(self, job)) {
+                {
+                    std::lock_guard<std::mutex> lock(sleepMutex);
+                    queued--;
+                }
+                job();
+            }
+        }
+    }
+
+    std::vector<std::unique_ptr<Worker>> workers;
+    std::vector<std::thread> threads;
+    std::mutex sleepMutex;
+    std::condition_variable jobAdded;
+    size_t queued = 0; // Jobs waiting in any deque, under sleepMutex.
+    bool stopping = false;
+    std::atomic<size_t> nextWorker{0};
+    static thread_local int currentWorker; // Which worker this thread is, -1 for other threads.
+};
+
+thread_local int ThreadPool::currentWorker = -1;
+
+// Runs work(0) ... work(count - 1) spread over one thread per core.
+void parallelFor(size_t count, const std::function<void(size_t)> &work) {
+    ThreadPool::shared().parallelFor(count, work);
+}
+
+struct ReplaceResult {
+    size_t replacements = 0;
+    std::vector<std::string> samples; // A few "-old/+new" lines for the dry run.
+    std::string error;
+};
+
+// Streams one file through find/replace in fixed size chunks. Only the last
+// (search length - 1) bytes are carried over between chunks so a match can span
+// two reads, which keeps memory the same for a 1 KB or a 100 GB file. When outFd
+// is -1 nothing is written and the matches are only counted (dry run).
+bool streamReplace(int inFd, int outFd, const std::string &searchStr, const std::string &replaceStr, ReplaceResult &result) {
+    const size_t chunkSize = 1 << 20;
+    const size_t maxSamples = 3;
+    const size_t contextSize = 30;
+    std::vector<char> buffer(chunkSize + searchStr.size());
+    std::string output;
+    output.reserve(chunkSize + replaceStr.size());
+    size_t filled = 0;
+    size_t lineNumber = 1;
+    bool atEnd = false;
+
+    while (!atEnd) {
+        ssize_t got = read(inFd, buffer.data() + filled, chunkSize);
+        if (got < 0) {
+            if (errno == EINTR) continue;
+            result.error = "Could not read the file";
+            return false;
+        }
+        filled += got;
+        atEnd = (got == 0);
+
+        // Bytes past safeEnd might be the start of a match that finishes in the next chunk.
+        size_t safeEnd = atEnd ? filled : (filled > searchStr.size() - 1 ? filled - (searchStr.size() - 1) : 0);
+        size_t pos = 0;
+        while (pos < safeEnd) {
+            const char *hit = static_cast<const char *>(
+                memmem(buffer.data() + pos, filled - pos, searchStr.data(), searchStr.size()));
+            size_t matchPos = hit ? hit - buffer.data() : filled;
+            size_t copyEnd = std::min(matchPos, safeEnd);
+
+            if (outFd >= 0) output.append(buffer.data() + pos, copyEnd - pos);
+            lineNumber += std::count(buffer.data() + pos, buffer.data() + copyEnd, '\n');
+            pos = copyEnd;
+            if (matchPos >= safeEnd) break;
+
+            if (result.samples.size() < maxSamples) {
+                // Show the match with a little of its line either side of it.
+                size_t from = matchPos > contextSize ? matchPos - contextSize : 0;
+                size_t to = std::min(filled, matchPos + searchStr.size() + contextSize);
+                const char *lineStart = static_cast<const char *>(memrchr(buffer.data() + from, '\n', matchPos - from));
+                if (lineStart) from = lineStart - buffer.data() + 1;
+                const char *lineEnd = static_cast<const char *>(memchr(buffer.data() + matchPos, '\n', to - matchPos));
+                if (lineEnd) to = lineEnd - buffer.data();
+                std::string before(buffer.data() + from, matchPos - from);
+                std::string after(buffer.data() + matchPos + searchStr.size(), to - matchPos - searchStr.size());
+                result.samples.push_back("  line " + std::to_string(lineNumber) + ": -" + before + searchStr + after);
+                result.samples.push_back("  line " + std::to_string(lineNumber) + ": +" + before + replaceStr + after);
+            }
+            if (outFd >= 0) {
+                output += replaceStr;
+                // A long NEW over many short matches can grow the output far past
+                // the chunk, so write it out as soon as it is a chunk's worth.
+                if (output.size() >= chunkSize) {
+                    if (!writeAll(outFd, output.data(), output.size())) {
+                        result.error = "Could not write the file";
+                        return false;
+                    }
+                    output.clear();
+                }
+            }
+            lineNumber += std::count(searchStr.begin(), searchStr.end(), '\n');
+            result.replacements++;
+            pos += searchStr.size();
+        }
+
+        if (outFd >= 0 && (output.size() >= chunkSize || atEnd)) {
+            if (!writeAll(outFd, output.data(), output.size())) {
+                result.error = "Could not write the file";
+                return false;
+            }
+            output.clear();
+        }
+        // Keep the unfinished tail for the next read.
+        memmove(buffer.data(), buffer.data() + pos, filled - pos);
+        filled -= pos;
+    }
+    return true;
+}
+
+// Replaces one file. The new text goes into a temp file that only replaces the
+// original when at least one match was found and everything was written.
+void replaceInFile(const std::string &filename, const std::string &searchStr, const std::string &replaceStr, bool dryRun, ReplaceResult &result) {
+    if (!isSafePath(filename)) {
+        result.error = "Invalid file path";
+        return;
+    }
     if (!checkPermission(filename, EXISTS)) {
-        // File doesn't exist - start with empty buffer
-        content.push_back("");
-        isModified = false;
+        result.error = "File doesn't exist";
+        return;
+    }
+    if (!checkPermission(filename, READABLE) || (!dryRun && !checkPermission(filename, WRITEABLE))) {
+        result.error = "No permission to change the file";
         return;
     }
 
-    // File exists - check read permission
-    if (!checkPermission(filename, READABLE)) {
-        drawMessage("Error: No read permission - opening read-only! :(");
-        content.push_back(""); // Start with empty buffer
-        isModified = false;
+    std::string target = resolveSymlinks(filename);
+
+    int inFd = open(target.c_str(), O_RDONLY | O_CLOEXEC);
+    if (inFd < 0) {
+        result.error = "Could not open the file";
+        return;
+    }
+    struct stat info;
+    if (fstat(inFd, &info) != 0 || !S_ISREG(info.st_mode)) {
+        result.error = "Not a regular file";
+        close(inFd);
         return;
     }
+    posix_fadvise(inFd, 0, 0, POSIX_FADV_SEQUENTIAL);
 
-    // Try to open the file
-    std::ifstream file(filename);
-    if (!file.is_open()) {
-        drawMessage("Error: Could not open the file! :(");
-        content.push_back("");
+    std::string tempPath;
+    int outFd = -1;
+    if (!dryRun) {
+        outFd = openTempBeside(target, tempPath);
+        if (outFd < 0) {
+            result.error = "Could not create the temporary file";
+            close(inFd);
+            return;
+        }
+    }
+
+    bool ok = streamReplace(inFd, outFd, searchStr, replaceStr, result);
+    close(inFd);
+    if (dryRun) return;
+
+    if (!ok || result.replacements == 0) {
+        close(outFd);
+        unlink(tempPath.c_str());
         return;
     }
-    
-    // Read file content
-    std::string line;
-    while (std::getline(file, line)) {
-        content.push_back(line);
+    if (!commitTemp(outFd, tempPath, target)) {
+        result.error = "Could not save the file";
+        result.replacements = 0;
     }
-    
-    if (content.empty()) {
-        content.push_back(""); // Ensure at least one line
+}
+
+// Writes every line followed by a newline with writev. Long lines are handed to
+// the kernel straight from the line strings without copying; short lines (and
+// the newlines) are packed into a staging buffer first, because thousands of
+// tiny iovecs cost more than copying the bytes. Each call passes up to IOV_MAX
+// pieces at once instead of one small write per line.
+template <typename Lines>
+bool writeLines(int fd, const Lines &lines) {
+    const size_t copyLimit = 512;
+    std::vector<char> staging(1 << 20);
+    size_t used = 0, segmentStart = 0;
+    std::vector<struct iovec> batch;
+    batch.reserve(IOV_MAX);
+
+    auto endSegment = [&]() {
+        if (used > segmentStart) {
+            batch.push_back({staging.data() + segmentStart, used - segmentStart});
+        }
+        segmentStart = used;
+    };
+    auto flush = [&]() {
+        endSegment();
+        size_t first = 0;
+        while (first < batch.size()) {
+            ssize_t written = writev(fd, batch.data() + first, std::min<size_t>(batch.size() - first, IOV_MAX));
+            if (written < 0) {
+                if (errno == EINTR) continue;
+                return false;
+            }
+            // Skip whatever the kernel took, a short write can stop inside a piece.
+            while (first < batch.size() && (size_t)written >= batch[first].iov_len) {
+                written -= batch[first].iov_len;
+                first++;
+            }
+            if (first < batch.size()) {
+                batch[first].iov_base = static_cast<char *>(batch[first].iov_base) + written;
+                batch[first].iov_len -= written;
+            }
+        }
+        batch.clear();
+        used = segmentStart = 0;
+        return true;
+    };
+
+    for (const auto &line : lines) {
+        if (batch.size() + 3 > IOV_MAX || used + std::min(line.size(), copyLimit) + 1 > staging.size()) {
+            if (!flush()) return false;
+        }
+        if (line.size() < copyLimit) {
+            memcpy(staging.data() + used, line.data(), line.size());
+            used += line.size();
+        } else {
+            endSegment();
+            batch.push_back({const_cast<char *>(line.data()), line.size()});
+        }
+        staging[used++] = '\n';
     }
-    
+    return flush();
+}
+
+// Where each line starts, as a Fenwick tree over the line lengths (newline
+// included). Finding the byte offset of a line, or the line holding a byte,
+// and changing one line's length are all O(log n) instead of a walk over
+// every line before it.
+class LineOffsets {
+public:
+    void build(const std::vector<std::string> &lines) {
+        size_t n = lines.size();
+        tree.assign(n + 1, 0);
+        for (size_t i = 0; i < n; i++) {
+            tree[i + 1] = lines[i].size() + 1;
+        }
+        for (size_t i = 1; i <= n; i++) {
+            size_t parent = i + (i & -i);
+            if (parent <= n) {
+                tree[parent] += tree[i];
+            }
+        }
+    }
+
+    size_t size() const {
+        return tree.size() - 1;
+    }
+
+    // Bytes before the start of line (the sum of the lengths of the lines above it).
+    uint64_t offsetOf(size_t line) const {
+        uint64_t sum = 0;
+        for (size_t i = std::min(line, size()); i > 0; i -= i & -i) {
+            sum += tree[i];
+        }
+        return sum;
+    }
+
+    uint64_t lengthOf(size_t line) const {
+        return offsetOf(line + 1) - offsetOf(line);
+    }
+
+    void setLength(size_t line, uint64_t length) {
+        uint64_t old = lengthOf(line);
+        for (size_t i = line + 1; i <= size(); i += i & -i) {
+            tree[i] += length - old; // Wraps around when shrinking, the sums still come out right.
+        }
+    }
+
+    // Adds a line at the end.
+    void push(uint64_t length) {
+        size_t n = size() + 1;
+        tree.push_back(length + offsetOf(n - 1) - offsetOf(n - (n & -n)));
+    }
+
+    // The line holding the byte at offset (the last line for offsets past the end).
+    size_t lineAt(uint64_t offset) const {
+        size_t n = size(), line = 0;
+        size_t step = 1;
+        while (step * 2 <= n) step *= 2;
+        for (; step > 0; step /= 2) {
+            if (line + step <= n && tree[line + step] <= offset) {
+                line += step;
+                offset -= tree[line];
+            }
+        }
+        return std::min(line, n > 0 ? n - 1 : 0);
+    }
+
+private:
+    std::vector<uint64_t> tree{0}; // 1-based, tree[i] sums the lengths of lines i - lowbit(i) .. i - 1.
+};
+
+// Compressed files are unpacked when opened and packed again when saved, in
+// the same format. gzip comes from zlib; zstd is loaded when first needed, so
+// NemoS still runs (and builds) on systems without libzstd.
+enum Compression { COMPRESSION_NONE, COMPRESSION_GZIP, COMPRESSION_ZSTD };
+
+Compression detectCompression(const std::string &path) {
+    unsigned char magic[4] = {0, 0, 0, 0};
+    int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return COMPRESSION_NONE;
+    }
+    ssize_t got = read(fd, magic, sizeof(magic));
+    close(fd);
+    if (got >= 2 && magic[0] == 0x1f && magic[1] == 0x8b) {
+        return COMPRESSION_GZIP;
+    }
+    if (got == 4 && magic[0] == 0x28 && magic[1] == 0xb5 && magic[2] == 0x2f && magic[3] == 0xfd) {
+        return COMPRESSION_ZSTD;
+    }
+    return COMPRESSION_NONE;
+}
+
+// A new file is compressed if its name says so.
+Compression compressionForName(const std::string &name) {
+    auto endsWith = [&name](const char *suffix) {
+        size_t length = strlen(suffix);
+        return name.size() > length && name.compare(name.size() - length, length, suffix) == 0;
+    };
+    if (endsWith(".gz")) return COMPRESSION_GZIP;
+    if (endsWith(".zst")) return COMPRESSION_ZSTD;
+    return COMPRESSION_NONE;
+}
+
+// The parts of the zstd streaming API we use, looked up in libzstd.so.1.
+struct ZstdLibrary {
+    struct InBuffer { const void *src; size_t size; size_t pos; };
+    struct OutBuffer { void *dst; size_t size; size_t pos; };
+    enum { CONTINUE = 0, END = 2 };
+
+    void *(*createDCtx)();
+    size_t (*freeDCtx)(void *);
+    size_t (*decompressStream)(void *, OutBuffer *, InBuffer *);
+    void *(*createCCtx)();
+    size_t (*freeCCtx)(void *);
+    size_t (*compressStream2)(void *, OutBuffer *, InBuffer *, int);
+    unsigned (*isError)(size_t);
+
+    static const ZstdLibrary *get() {
+        static ZstdLibrary library;
+        static bool loaded = library.load();
+        return loaded ? &library : nullptr;
+    }
+
+private:
+    bool load() {
+        void *handle = dlopen("libzstd.so.1", RTLD_NOW | RTLD_LOCAL);
+        if (!handle) {
+            return false;
+        }
+        createDCtx = reinterpret_cast<void *(*)()>(dlsym(handle, "ZSTD_createDCtx"));
+        freeDCtx = reinterpret_cast<size_t (*)(void *)>(dlsym(handle, "ZSTD_freeDCtx"));
+        decompressStream = reinterpret_cast<size_t (*)(void *, OutBuffer *, InBuffer *)>(dlsym(handle, "ZSTD_decompressStream"));
+        createCCtx = reinterpret_cast<void *(*)()>(dlsym(handle, "ZSTD_createCCtx"));
+        freeCCtx = reinterpret_cast<size_t (*)(void *)>(dlsym(handle, "ZSTD_freeCCtx"));
+        compressStream2 = reinterpret_cast<size_t (*)(void *, OutBuffer *, InBuffer *, int)>(dlsym(handle, "ZSTD_compressStream2"));
+        isError = reinterpret_cast<unsigned (*)(size_t)>(dlsym(handle, "ZSTD_isError"));
+        return createDCtx && freeDCtx && decompressStream && createCCtx && freeCCtx && compressStream2 && isError;
+    }
+};
+
+// Unpacks a compressed file into sink a piece at a time. Several gzip members or
+// zstd frames one after another (cat a.gz b.gz) come out as one text.
+bool decompressFile(const std::string &path, Compression compression, const std::function<bool(const char *, size_t)> &sink) {
+    int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return false;
+    }
+    posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+    std::vector<char> in(1 << 18), out(1 << 18);
+    bool ok = true, wantMore = true;
+    ssize_t got = 0;
+
+    if (compression == COMPRESSION_GZIP) {
+        z_stream stream = {};
+        if (inflateInit2(&stream, 15 + 32) != Z_OK) { // 32: read the gzip header.
+            close(fd);
+            return false;
+        }
+        int result = Z_OK;
+        while (wantMore && (got = read(fd, in.data(), in.size())) > 0) {
+            stream.next_in = reinterpret_cast<Bytef *>(in.data());
+            stream.avail_in = got;
+            // Keep going while there is input, or output that didn't fit last time.
+            do {
+                if (result == Z_STREAM_END) {
+                    inflateReset(&stream); // The next member.
+                }
+                stream.next_out = reinterpret_cast<Bytef *>(out.data());
+                stream.avail_out = out.size();
+                result = inflate(&stream, Z_NO_FLUSH);
+                if (result != Z_OK && result != Z_STREAM_END && result != Z_BUF_ERROR) {
+                    ok = wantMore = false;
+                    break;
+                }
+                wantMore = sink(out.data(), out.size() - stream.avail_out);
+            } while (wantMore && (stream.avail_in > 0 || stream.avail_out == 0));
+        }
+        ok = ok && got >= 0 && (!wantMore || result == Z_STREAM_END);
+        inflateEnd(&stream);
+    } else {
+        const ZstdLibrary *zstd = ZstdLibrary::get();
+        void *context = zstd ? zstd->createDCtx() : nullptr;
+        if (!context) {
+            close(fd);
+            return false;
+        }
+        size_t result = 0;
+        while (wantMore && (got = read(fd, in.data(), in.size())) > 0) {
+            ZstdLibrary::InBuffer input = {in.data(), (size_t)got, 0};
+            ZstdLibrary::OutBuffer output;
+            do {
+                output = {out.data(), out.size(), 0};
+                result = zstd->decompressStream(context, &output, &input);
+                if (zstd->isError(result)) {
+                    ok = wantMore = false;
+                    break;
+                }
+                wantMore = sink(out.data(), output.pos);
+            } while (wantMore && (input.pos < input.size || output.pos == output.size));
+        }
+        // Whatever is still buffered inside zstd.
+        while (ok && wantMore && result != 0 && !zstd->isError(result)) {
+            ZstdLibrary::InBuffer input = {nullptr, 0, 0};
+            ZstdLibrary::OutBuffer output = {out.data(), out.size(), 0};
+            result = zstd->decompressStream(context, &output, &input);
+            if (output.pos == 0) break; // Nothing more, the file was cut short.
+            wantMore = sink(out.data(), output.pos);
+        }
+        ok = ok && got >= 0 && (!wantMore || result == 0);
+        zstd->freeDCtx(context);
+    }
+    close(fd);
+    return ok;
+}
+
+// Packs the lines into fd with a newline after each, the compressed writeLines.
+template <typename Lines>
+bool writeCompressed(int fd, const Lines &lines, Compression compression) {
+    std::vector<char> out(1 << 18);
+    std::string chunk;
+    const size_t chunkSize = 1 << 20;
+    auto next = lines.begin();
+
+    // Hands the next megabyte or so of text to pack, empty at the end.
+    auto fill = [&]() {
+        chunk.clear();
+        while (next != lines.end() && chunk.size() < chunkSize) {
+            chunk += *next;
+            chunk += '\n';
+            ++next;
+        }
+    };
+
+    if (compression == COMPRESSION_GZIP) {
+        z_stream stream = {};
+        if (deflateInit2(&stream, Z_DEFAULT_COMPRESSION, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+            return false;
+        }
+        bool ok = true;
+        int flush = Z_NO_FLUSH;
+        while (ok && flush != Z_FINISH) {
+            fill();
+            flush = (next == lines.end()) ? Z_FINISH : Z_NO_FLUSH;
+            stream.next_in = reinterpret_cast<Bytef *>(&chunk[0]);
+            stream.avail_in = chunk.size();
+            do {
+                stream.next_out = reinterpret_cast<Bytef *>(out.data());
+                stream.avail_out = out.size();
+                deflate(&stream, flush);
+                ok = writeAll(fd, out.data(), out.size() - stream.avail_out);
+            } while (ok && stream.avail_out == 0);
+        }
+        deflateEnd(&stream);
+        return ok;
+    }
+
+    const ZstdLibrary *zstd = ZstdLibrary::get();
+    void *context = zstd ? zstd->createCCtx() : nullptr;
+    if (!context) {
+        return false;
+    }
+    bool ok = true, last = false;
+    while (ok && !last) {
+        fill();
+        last = next == lines.end();
+        ZstdLibrary::InBuffer input = {chunk.data(), chunk.size(), 0};
+        size_t remaining;
+        do {
+            ZstdLibrary::OutBuffer output = {out.data(), out.size(), 0};
+            remaining = zstd->compressStream2(context, &output, &input, last ? ZstdLibrary::END : ZstdLibrary::CONTINUE);
+            ok = !zstd->isError(remaining) && writeAll(fd, out.data(), output.pos);
+        } while (ok && (last ? remaining != 0 : input.pos < input.size));
+    }
+    zstd->freeCCtx(context);
+    return ok;
+}
+
+// Saves the lines through a temp file that is renamed over the original. If the
+// directory can't take a temp file the save fails, the file is never cut short
+// and rewritten in place.
+template <typename Lines>
+bool saveLines(const std::string &filename, const Lines &lines, Compression compression = COMPRESSION_NONE) {
+    std::string target = resolveSymlinks(filename);
+    std::string tempPath;
+    int fd = openTempBeside(target, tempPath);
+    if (fd >= 0) {
+        bool written = (compression == COMPRESSION_NONE) ? writeLines(fd, lines) : writeCompressed(fd, lines, compression);
+        if (!written) {
+            close(fd);
+            unlink(tempPath.c_str());
+            return false;
+        }
+        return commitTemp(fd, tempPath, target);
+    }
+    return false;
+}
+
+// A piece of the file that an in place save overwrites.
+struct SavePatch {
+    uint64_t offset;
+    std::string data;
+};
+
+// Before an in place save touches the file, every patch is written to this
+// journal and flushed. If we crash half way, the next open replays the journal
+// and the file ends up exactly as the save meant it to be.
+std::string patchJournalPath(const std::string &target) {
+    size_t last_slash = target.find_last_of('/');
+    std::string dir = (last_slash == std::string::npos) ? "" : target.substr(0, last_slash + 1);
+    std::string base = (last_slash == std::string::npos) ? target : target.substr(last_slash + 1);
+    return dir + "." + base + ".nemos-journal";
+}
+
+static const char patchJournalMagic[8] = {'N', 'E', 'M', 'O', 'S', 'J', '0', '2'};
+
+// Which file a journal was written for, and how it looked before the save
+// touched it. A journal is only replayed onto that same file.
+struct PatchJournalTarget {
+    uint64_t device, inode, size;
+    int64_t mtimeSeconds, mtimeNanoseconds;
+};
+
+PatchJournalTarget patchJournalTargetOf(const struct stat &info) {
+    return {(uint64_t)info.st_dev, (uint64_t)info.st_ino, (uint64_t)info.st_size,
+            (int64_t)info.st_mtim.tv_sec, (int64_t)info.st_mtim.tv_nsec};
+}
+
+// FNV-1a, only used to tell a complete journal from one that was cut short.
+uint64_t hashBytes(const char *data, size_t size, uint64_t hash = 14695981039346656037ULL) {
+    for (size_t i = 0; i < size; i++) {
+        hash = (hash ^ (unsigned char)data[i]) * 1099511628211ULL;
+    }
+    return hash;
+}
+
+// Writes the patches into the file with pwrite and cuts it to newSize.
+bool writePatches(const std::string &target, const std::vector<SavePatch> &patches, uint64_t newSize) {
+    int fd = open(target.c_str(), O_WRONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return false;
+    }
+    bool ok = true;
+    for (const auto &patch : patches) {
+        const char *data = patch.data.data();
+        size_t left = patch.data.size();
+        off_t offset = patch.offset;
+        while (ok && left > 0) {
+            ssize_t written = pwrite(fd, data, left, offset);
+            if (written < 0 && errno == EINTR) continue;
+            if (written <= 0) {
+                ok = false;
+                break;
+            }
+            data += written;
+            left -= written;
+            offset += written;
+        }
+    }
+    ok = ok && ftruncate(fd, newSize) == 0 && fsync(fd) == 0;
+    return close(fd) == 0 && ok;
+}
+
+// Saves by changing only the given parts of the file, behind the journal.
+bool savePatches(const std::string &target, const std::vector<SavePatch> &patches, uint64_t newSize) {
+    std::string journalPath = patchJournalPath(target);
+    struct stat before;
+    if (stat(target.c_str(), &before) != 0) {
+        return false;
+    }
+    PatchJournalTarget identity = patchJournalTargetOf(before);
+    int fd = open(journalPath.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+    if (fd < 0) {
+        return false;
+    }
+
+    uint64_t hash = hashBytes(patchJournalMagic, sizeof(patchJournalMagic));
+    bool ok = writeAll(fd, patchJournalMagic, sizeof(patchJournalMagic));
+    auto writeHashed = [&](const void *data, size_t size) {
+        hash = hashBytes(static_cast<const char *>(data), size, hash);
+        ok = ok && writeAll(fd, static_cast<const char *>(data), size);
+    };
+    uint64_t count = patches.size();
+    writeHashed(&identity, sizeof(identity));
+    writeHashed(&newSize, sizeof(newSize));
+    writeHashed(&count, sizeof(count));
+    for (const auto &patch : patches) {
+        uint64_t length = patch.data.size();
+        writeHashed(&patch.offset, sizeof(patch.offset));
+        writeHashed(&length, sizeof(length));
+        writeHashed(patch.data.data(), patch.data.size());
+    }
+    ok = ok && writeAll(fd, reinterpret_cast<const char *>(&hash), sizeof(hash)) && fsync(fd) == 0;
+    ok = (close(fd) == 0) && ok;
+    if (!ok) {
+        unlink(journalPath.c_str());
+        return false;
+    }
+    syncDirectoryOf(journalPath);
+
+    // Only a crash leaves the journal behind for the next open to finish. A save
+    // that failed is written again in full by the next one, which doesn't look
+    // at the journal, so it must not be replayed over that later.
+    ok = writePatches(target, patches, newSize);
+    unlink(journalPath.c_str());
+    syncDirectoryOf(journalPath);
+    return ok;
+}
+
+// Removes the journal of an in place save, once the whole file has been saved.
+void dropPatchJournal(const std::string &target) {
+    std::string journalPath = patchJournalPath(target);
+    if (unlink(journalPath.c_str()) != 0) {
+        return;
+    }
+    syncDirectoryOf(journalPath);
+}
+
+// Finishes an in place save that was interrupted. Returns 1 if a journal was
+// replayed, 0 if there was nothing to do and -1 if replaying it failed. A journal
+// that was never completely written is thrown away, the file wasn't touched yet.
+// So is one written for another file, or for this file before someone else
+// changed it: it has to be the same inode, and either untouched since (same
+// size and time) or changed soon after the journal, by the save that crashed.
+int recoverPatchJournal(const std::string &target) {
+    std::string journalPath = patchJournalPath(target);
+    std::ifstream journal(journalPath, std::ios::binary);
+    if (!journal.is_open()) {
+        return 0;
+    }
+    std::string bytes((std::istreambuf_iterator<char>(journal)), std::istreambuf_iterator<char>());
+    journal.close();
+
+    const size_t headerSize = sizeof(patchJournalMagic) + sizeof(PatchJournalTarget) + 2 * sizeof(uint64_t);
+    uint64_t storedHash = 0;
+    bool valid = bytes.size() >= headerSize + sizeof(storedHash) &&
+                 memcmp(bytes.data(), patchJournalMagic, sizeof(patchJournalMagic)) == 0;
+    if (valid) {
+        memcpy(&storedHash, bytes.data() + bytes.size() - sizeof(storedHash), sizeof(storedHash));
+        valid = hashBytes(bytes.data(), bytes.size() - sizeof(storedHash)) == storedHash;
+    }
+
+    std::vector<SavePatch> patches;
+    uint64_t newSize = 0, count = 0;
+    size_t pos = sizeof(patchJournalMagic);
+    size_t end = bytes.size() - sizeof(storedHash);
+    if (valid) {
+        PatchJournalTarget identity;
+        memcpy(&identity, bytes.data() + pos, sizeof(identity));
+        pos += sizeof(identity);
+        struct stat now, journalInfo;
+        valid = stat(target.c_str(), &now) == 0 && stat(journalPath.c_str(), &journalInfo) == 0 &&
+                identity.device == (uint64_t)now.st_dev && identity.inode == (uint64_t)now.st_ino;
+        if (valid) {
+            bool untouched = identity.size == (uint64_t)now.st_size && identity.mtimeSeconds == now.st_mtim.tv_sec &&
+                             identity.mtimeNanoseconds == now.st_mtim.tv_nsec;
+            long long sinceJournal = (long long)now.st_mtim.tv_sec - journalInfo.st_mtim.tv_sec;
+            valid = untouched || (sinceJournal >= 0 && sinceJournal <= 60);
+        }
+    }
+    if (valid) {
+        memcpy(&newSize, bytes.data() + pos, sizeof(newSize));
+        memcpy(&count, bytes.data() + pos + sizeof(newSize), sizeof(count));
+        pos += 2 * sizeof(uint64_t);
+        for (uint64_t n = 0; n < count && valid; n++) {
+            SavePatch patch;
+            uint64_t length = 0;
+            valid = pos + 2 * sizeof(uint64_t) <= end;
+            if (!valid) break;
+            memcpy(&patch.offset, bytes.data() + pos, sizeof(patch.offset));
+            memcpy(&length, bytes.data() + pos + sizeof(patch.offset), sizeof(length));
+            pos += 2 * sizeof(uint64_t);
+            valid = length <= end - pos;
+            if (!valid) break;
+            patch.data.assign(bytes.data() + pos, length);
+            pos += length;
+            patches.push_back(std::move(patch));
+        }
+    }
+
+    if (!valid) {
+        unlink(journalPath.c_str());
+        return 0;
+    }
+    if (!writePatches(target, patches, newSize)) {
+        return -1;
+    }
+    unlink(journalPath.c_str());
+    syncDirectoryOf(journalPath);
+    return 1;
+}
+
+// --bench-save command that times saving a large made up document, once the way
+// saving used to work and once through saveLines.
+int BenchSave(int argc, char *argv[], int i) {
+    size_t megabytes = 256;
+    if (i + 1 < argc) {
+        megabytes = std::max(1, atoi(argv[i + 1]));
+    }
+
+    // Lines of a few different lengths, like a normal text file.
+    std::vector<std::string> lines;
+    size_t total = 0;
+    for (size_t n = 0; total < megabytes * 1024 * 1024; n++) {
+        lines.emplace_back(20 + (n * 37) % 100, 'a' + n % 26);
+        total += lines.back().size() + 1;
+    }
+    // A directory only we can get into, so nobody can put a symlink where we write.
+    char dir[] = "/tmp/nemos-bench-XXXXXX";
+    if (!mkdtemp(dir)) {
+        std::cerr << "Error: Could not make a directory in /tmp! :(\n";
+        return 1;
+    }
+    std::string path = std::string(dir) + "/save.txt";
+    std::cout << "Saving " << lines.size() << " lines (" << megabytes << " MB)\n";
+
+    auto seconds = [](std::chrono::steady_clock::time_point start) {
+        return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    };
+
+    auto start = std::chrono::steady_clock::now();
+    {
+        std::ofstream file(path);
+        for (const auto &line : lines) {
+            file << line << "\n";
+        }
+    }
+    int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC); // Both ways end on the disk.
+    bool ok = fd >= 0 && fsync(fd) == 0;
+    if (fd >= 0) close(fd);
+    double streamTime = seconds(start);
+
+    start = std::chrono::steady_clock::now();
+    ok = saveLines(path, lines) && ok;
+    double saveTime = seconds(start);
+    std::remove(path.c_str());
+    rmdir(dir);
+
+    if (!ok) {
+        std::cerr << "Error: Could not write " << path << "! :(\n";
+        return 1;
+    }
+    std::cout << std::fixed << std::setprecision(1)
+              << "ofstream + fsync, line at a time: " << streamTime << " s  (" << megabytes / streamTime << " MB/s)\n"
+              << "writev + fsync + rename:          " << saveTime << " s  (" << megabytes / saveTime << " MB/s)\n";
+    return 0;
+}
+
+// --replace command to replace text in many files without opening them.
+int ReplaceInFiles(int argc, char *argv[], int i) {
+    // --dry-run only counts right after --replace, so a file can still be called that.
+    int first = i + 1;
+    bool dryRun = first < argc && std::string(argv[first]) == "--dry-run";
+    if (dryRun) first++;
+    std::vector<std::string> args(argv + first, argv + argc);
+    if (args.size() < 3) {
+        std::cerr << "Error: Usage is nemos --replace [--dry-run] OLD NEW files... :(\n";
+        return 1;
+    }
+    const std::string searchStr = args[0];
+    const std::string replaceStr = args[1];
+    if (searchStr.empty()) {
+        std::cerr << "Error: The text to replace can't be empty! :(\n";
+        return 1;
+    }
+
+    std::vector<std::string> files(args.begin() + 2, args.end());
+    std::vector<ReplaceResult> results(files.size());
+    parallelFor(files.size(), [&](size_t index) {
+        replaceInFile(files[index], searchStr, replaceStr, dryRun, results[index]);
+    });
+
+    size_t totalReplacements = 0;
+    size_t changedFiles = 0;
+    int status = 0;
+    for (size_t index = 0; index < files.size(); index++) {
+        const ReplaceResult &result = results[index];
+        if (!result.error.empty()) {
+            std::cerr << "Error: " << files[index] << ": " << result.error << "! :(\n";
+            status = 1;
+            continue;
+        }
+        if (result.replacements == 0) continue;
+        totalReplacements += result.replacements;
+        changedFiles++;
+        std::cout << files[index] << ": " << result.replacements << " replacement(s)\n";
+        if (dryRun) {
+            for (const auto &sample : result.samples) {
+                std::cout << sample << "\n";
+            }
+        }
+    }
+
+    if (dryRun) {
+        std::cout << "Dry run: " << totalReplacements << " replacement(s) in " << changedFiles
+                  << " of " << files.size() << " file(s), nothing has been written.\n";
+    } else {
+        std::cout << "Replaced " << totalReplacements << " occurrence(s) in " << changedFiles
+                  << " of " << files.size() << " file(s). :)\n";
+    }
+    return status;
+}
+
+
+
+// The swap file is an append only log of every edit, kept next to the file as
+// .name.nemos-swp. Edits are added to a buffer in memory (a few microseconds a
+// key) and a flusher thread writes and fsyncs that buffer once a second, so
+// typing never waits on the disk. If NemoS dies before saving, the next start
+// replays the log on top of the file and the work is back.
+enum EditType : uint8_t {
+    EDIT_INSERT = 1,  // Text put in at (y, x).
+    EDIT_ERASE,       // count characters removed at (y, x).
+    EDIT_REPLACE,     // count characters at (y, x) replaced by the text.
+    EDIT_SPLIT,       // Enter at (y, x).
+    EDIT_JOIN,        // Line y + 1 joined onto line y.
+    EDIT_LINES,       // Several lines put in at (y, x), separated by newlines.
+    EDIT_SET,         // The whole document replaced (undo and redo), separated by newlines.
+    EDIT_ERASE_RANGE  // (y, x) up to (y + count, the column in text) removed.
+};
+
+struct EditRecord {
+    EditType type;
+    int32_t y = 0, x = 0, count = 0;
+    std::string text;
+};
+
+// Where the swap file for a document lives.
+std::string swapPathFor(const std::string &filename) {
+    std::string target = resolveSymlinks(filename);
+    size_t last_slash = target.find_last_of('/');
+    std::string dir = (last_slash == std::string::npos) ? "" : target.substr(0, last_slash + 1);
+    std::string base = (last_slash == std::string::npos) ? target : target.substr(last_slash + 1);
+    return dir + "." + base + ".nemos-swp";
+}
+
+class EditJournal {
+public:
+    ~EditJournal() {
+        close(true);
+    }
+
+    // Opens and locks the swap file without touching what is in it yet. Returns
+    // false if it can't be made or another NemoS is already using it.
+    bool open(const std::string &path) {
+        close(false);
+        int newFd = ::open(path.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+        if (newFd < 0) {
+            return false;
+        }
+        if (flock(newFd, LOCK_EX | LOCK_NB) != 0) {
+            ::close(newFd);
+            return false;
+        }
+        fd = newFd;
+        swapPath = path;
+        return true;
+    }
+
+    // Empties the swap file and starts logging edits made on top of the file
+    // described by base (or a file that doesn't exist yet when base is null).
+    void start(const struct stat *base) {
+        if (fd < 0 || ftruncate(fd, 0) != 0) {
+            return;
+        }
+        std::lock_guard<std::mutex> lock(mutex);
+        pending = header(base);
+        stopping = false;
+        started = true;
+        flusher = std::thread(&EditJournal::flushLoop, this);
+    }
+
+    // Stops the flusher and lets go of the swap file, deleting it if asked to.
+    void close(bool removeFile) {
+        if (fd < 0) {
+            return;
+        }
+        if (started) {
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                stopping = true;
+            }
+            wake.notify_one();
+            flusher.join();
+            started = false;
+        }
+        if (removeFile) {
+            unlink(swapPath.c_str());
+        }
+        ::close(fd);
+        fd = -1;
+        pending.clear();
+        sinceCheckpoint.clear();
+        checkpointActive = false;
+    }
+
+    void append(EditType type, int y, int x, int count, const std::string &text) {
+        if (!started) {
+            return;
+        }
+        std::string record;
+        record.resize(recordHeaderSize + 1 + 3 * sizeof(int32_t));
+        char *out = &record[recordHeaderSize];
+        *out++ = type;
+        int32_t numbers[3] = {y, x, count};
+        memcpy(out, numbers, sizeof(numbers));
+        record += text;
+        uint32_t length = record.size() - recordHeaderSize;
+        uint32_t check = hashBytes(record.data() + recordHeaderSize, length);
+        memcpy(&record[0], &length, sizeof(length));
+        memcpy(&record[sizeof(length)], &check, sizeof(check));
+
+        std::lock_guard<std::mutex> lock(mutex);
+        if (pending.empty()) {
+            wake.notify_one(); // The flusher sleeps while there is nothing to write.
+        }
+        pending += record;
+        if (checkpointActive) {
+            sinceCheckpoint += record;
+        }
+    }
+
+    // A save has taken its copy of the text. Edits from now on belong on top of
+    // that copy, so they are kept aside until the save says how it went.
+    void checkpoint() {
+        std::lock_guard<std::mutex> lock(mutex);
+        checkpointActive = true;
+        sinceCheckpoint.clear();
+    }
+
+    // The save worked: the swap file starts again from the saved file, with only
+    // the edits made while it was being written.
+    void rebase(const struct stat &base) {
+        if (!started) {
+            return;
+        }
+        std::lock_guard<std::mutex> lock(mutex);
+        pending = header(&base) + sinceCheckpoint;
+        sinceCheckpoint.clear();
+        checkpointActive = false;
+        truncateFirst = true;
+        wake.notify_one();
+    }
+
+    // The save failed, so the file on disk is still the old one.
+    void dropCheckpoint() {
+        std::lock_guard<std::mutex> lock(mutex);
+        sinceCheckpoint.clear();
+        checkpointActive = false;
+    }
+
+    void renameTo(const std::string &path) {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (fd >= 0 && rename(swapPath.c_str(), path.c_str()) == 0) {
+            swapPath = path;
+        }
+    }
+
+    // Called from the editor loop when the terminal goes away or we are killed,
+    // just before dying. A batch the flusher is writing goes first, so the
+    // records stay in order.
+    void emergencyFlush() {
+        if (!started) {
+            return;
+        }
+        std::unique_lock<std::mutex> lock(mutex);
+        batchWritten.wait(lock, [this]() { return !writing; });
+        if (truncateFirst && ftruncate(fd, 0) == 0) {
+            lseek(fd, 0, SEEK_SET);
+        }
+        truncateFirst = false;
+        writeAll(fd, pending.data(), pending.size());
+        pending.clear();
+        fdatasync(fd);
+    }
+
+    // Reads a swap file left behind by an earlier run. base is checked against the
+    // file the edits were made on; records after a damaged one are ignored.
+    static bool read(const std::string &path, const struct stat *base, std::vector<EditRecord> &records, bool &matchesFile) {
+        std::ifstream file(path, std::ios::binary);
+        if (!file.is_open()) {
+            return false;
+        }
+        std::string bytes((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+        std::string expected = header(base);
+        if (bytes.size() < expected.size() || memcmp(bytes.data(), swapMagic, sizeof(swapMagic)) != 0) {
+            return false;
+        }
+        matchesFile = bytes.compare(0, expected.size(), expected) == 0;
+
+        size_t pos = expected.size();
+        while (pos + recordHeaderSize <= bytes.size()) {
+            uint32_t length = 0, check = 0;
+            memcpy(&length, bytes.data() + pos, sizeof(length));
+            memcpy(&check, bytes.data() + pos + sizeof(length), sizeof(check));
+            pos += recordHeaderSize;
+            if (length < 1 + 3 * sizeof(int32_t) || length > bytes.size() - pos ||
+                (uint32_t)hashBytes(bytes.data() + pos, length) != check) {
+                break; // Cut off half way through a write.
+            }
+            EditRecord record;
+            record.type = (EditType)bytes[pos];
+            int32_t numbers[3];
+            memcpy(numbers, bytes.data() + pos + 1, sizeof(numbers));
+            record.y = numbers[0];
+            record.x = numbers[1];
+            record.count = numbers[2];
+            record.text.assign(bytes.data() + pos + 1 + sizeof(numbers), length - 1 - sizeof(numbers));
+            records.push_back(std::move(record));
+            pos += length;
+        }
+        return true;
+    }
+
+private:
+    static constexpr char swapMagic[8] = {'N', 'E', 'M', 'O', 'S', 'W', '0', '1'};
+    static constexpr size_t recordHeaderSize = 2 * sizeof(uint32_t);
+
+    // The magic followed by what the file looked like, so edits are never
+    // replayed on top of a file that has changed since.
+    static std::string header(const struct stat *base) {
+        int64_t identity[5] = {0, 0, -1, 0, 0};
+        if (base) {
+            identity[0] = base->st_dev;
+            identity[1] = base->st_ino;
+            identity[2] = base->st_size;
+            identity[3] = base->st_mtim.tv_sec;
+            identity[4] = base->st_mtim.tv_nsec;
+        }
+        std::string bytes(swapMagic, sizeof(swapMagic));
+        bytes.append(reinterpret_cast<const char *>(identity), sizeof(identity));
+        return bytes;
+    }
+
+    void flushLoop() {
+        std::unique_lock<std::mutex> lock(mutex);
+        while (true) {
+            // Asleep until there is something to write, then a second for more edits to pile up.
+            wake.wait(lock, [this]() { return stopping || truncateFirst || !pending.empty(); });
+            wake.wait_for(lock, std::chrono::seconds(1), [this]() { return stopping || truncateFirst; });
+            std::string batch;
+            batch.swap(pending);
+            bool truncate = truncateFirst;
+            truncateFirst = false;
+            bool stop = stopping;
+            writing = true;
+            lock.unlock();
+
+            if (truncate && ftruncate(fd, 0) == 0) {
+                lseek(fd, 0, SEEK_SET);
+            }
+            if (!batch.empty()) {
+                writeAll(fd, batch.data(), batch.size());
+                fdatasync(fd);
+            }
+
+            lock.lock();
+            writing = false;
+            batchWritten.notify_all();
+            if (stop) {
+                return;
+            }
+        }
+    }
+
+    int fd = -1;
+    std::string swapPath;
+    std::mutex mutex;
+    std::condition_variable wake;
+    std::condition_variable batchWritten;
+    std::thread flusher;
+    std::string pending;          // Records not written to the swap file yet.
+    std::string sinceCheckpoint;  // Records made while a save is running.
+    bool checkpointActive = false;
+    bool truncateFirst = false;
+    bool writing = false; // The flusher is writing a batch outside the lock.
+    bool stopping = false;
+    bool started = false;
+};
+
+// Watches the open file for changes made by other programs. The directory is
+// watched rather than the file, so a program that saves by renaming a new file
+// over ours (like we do) is noticed too. Nothing here ever blocks.
+class FileWatcher {
+public:
+    ~FileWatcher() {
+        stop();
+    }
+
+    bool watch(const std::string &filename) {
+        stop();
+        std::string target = resolveSymlinks(filename);
+        size_t last_slash = target.find_last_of('/');
+        std::string dir = (last_slash == std::string::npos) ? "." : target.substr(0, last_slash);
+        if (dir.empty()) dir = "/";
+        name = (last_slash == std::string::npos) ? target : target.substr(last_slash + 1);
+
+        fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+        if (fd < 0) {
+            return false;
+        }
+        if (inotify_add_watch(fd, dir.c_str(), IN_MODIFY | IN_CLOSE_WRITE | IN_ATTRIB | IN_CREATE |
+                                                  IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO) < 0) {
+            stop();
+            return false;
+        }
+        return true;
+    }
+
+    void stop() {
+        if (fd >= 0) {
+            close(fd);
+            fd = -1;
+        }
+    }
+
+    // Readable when there are events, -1 when not watching.
+    int descriptor() const {
+        return fd;
+    }
+
+    // Reads whatever events are waiting. True if any of them was about our file.
+    bool changed() {
+        if (fd < 0) {
+            return false;
+        }
+        alignas(struct inotify_event) char buffer[16384];
+        bool hit = false;
+        ssize_t got;
+        while ((got = read(fd, buffer, sizeof(buffer))) > 0) {
+            for (char *p = buffer; p < buffer + got;) {
+                const struct inotify_event *event = reinterpret_cast<const struct inotify_event *>(p);
+                if ((event->mask & IN_Q_OVERFLOW) || (event->len > 0 && name == event->name)) {
+                    hit = true;
+                }
+                p += sizeof(struct inotify_event) + event->len;
+            }
+        }
+        return hit;
+    }
+
+private:
+    int fd = -1;
+    std::string name;
+};
+
+// Reads up to size bytes at offset, used to check a file is the one we know.
+std::string readFileSample(const std::string &path, uint64_t offset, size_t size) {
+    std::string sample(size, '\0');
+    int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return "";
+    }
+    ssize_t got = pread(fd, &sample[0], size, offset);
+    close(fd);
+    sample.resize(got > 0 ? got : 0);
+    return sample;
+}
+
+// Decides when to save on its own: after the user has stopped typing for a
+// while, or after a number of edits even if they never stop. Bigger files wait
+// longer because each save costs more. Only runs when NEMOS_AUTOSAVE is on or 1.
+class AutosaveScheduler {
+public:
+    using Clock = std::chrono::steady_clock;
+
+    struct Policy {
+        uint64_t upToSize;  // Used for files up to this many bytes.
+        int idleSeconds;
+        int maxEdits;
+    };
+
+    // Off unless asked for: an autosave writes over the user's file, so Ctrl+S
+    // and the "leave without saving?" question would stop meaning anything.
+    // Edits are kept safe in the swap file either way.
+    AutosaveScheduler() {
+        const char *setting = getenv("NEMOS_AUTOSAVE");
+        enabled = setting && (std::string(setting) == "on" || std::string(setting) == "1");
+    }
+
+    bool isEnabled() const {
+        return enabled;
+    }
+
+    void configure(uint64_t fileSize) {
+        static const Policy policies[] = {
+            {1ULL << 20, 2, 50},       // Up to 1 MB
+            {64ULL << 20, 5, 300},     // Up to 64 MB
+            {1ULL << 30, 15, 2000},    // Up to 1 GB
+            {UINT64_MAX, 60, 10000},   // Anything bigger
+        };
+        for (const auto &candidate : policies) {
+            if (fileSize <= candidate.upToSize) {
+                policy = candidate;
+                break;
+            }
+        }
+    }
+
+    // Stops autosaving until the user saves this file by hand.
+    void setPaused(bool on) {
+        paused = on;
+    }
+
+    void noteEdit() {
+        edits++;
+        lastEdit = Clock::now();
+    }
+
+    // A save has taken its copy, edits from now on count towards the next one.
+    void noteSave() {
+        edits = 0;
+    }
+
+    bool due() const {
+        return enabled && !paused && edits > 0 &&
+               (edits >= policy.maxEdits || Clock::now() - lastEdit >= std::chrono::seconds(policy.idleSeconds));
+    }
+
+    // How long the editor may sleep before the next autosave is due, -1 for ever.
+    int msUntilDue() const {
+        if (!enabled || paused || edits == 0) {
+            return -1;
+        }
+        auto left = std::chrono::duration_cast<std::chrono::milliseconds>(
+            lastEdit + std::chrono::seconds(policy.idleSeconds) - Clock::now()).count();
+        return std::max<long long>(0, left);
+    }
+
+private:
+    Policy policy{1ULL << 20, 2, 50};
+    bool enabled = false;
+    bool paused = false;
+    int edits = 0;
+    Clock::time_point lastEdit;
+};
+
+// The swap file of the open document, flushed if the terminal hangs up or we are killed.
+EditJournal *signalJournal = nullptr;
+
+// SIGHUP, SIGTERM and SIGQUIT come in through the event loop: save the swap
+// file, put the terminal back and die of the signal like we would have anyway.
+void dieOfSignal(int sig) {
+    if (signalJournal) {
+        signalJournal->emergencyFlush();
+    }
+    endwin();
+    signal(sig, SIG_DFL);
+    sigset_t only;
+    sigemptyset(&only);
+    sigaddset(&only, sig);
+    pthread_sigmask(SIG_UNBLOCK, &only, nullptr);
+    raise(sig);
+    _exit(128 + sig);
+}
+
+// Fills the buffer from something slow on its own thread: a pipe (cmd | nemos -)
+// or a compressed file being unpacked. The editor is usable straight away and
+// the main loop collects whatever has arrived.
+class StreamReader {
+public:
+    // Gets the bytes as they come, returns false to stop.
+    using Sink = std::function<bool(const char *, size_t)>;
+
+    ~StreamReader() {
+        stop();
+    }
+
+    // An eventfd that gets poked whenever there is something to take.
+    void wakeOnData(int fd) {
+        wakeFd = fd;
+    }
+
+    // producer pushes everything into the sink and returns false if it failed.
+    void start(std::function<bool(const Sink &)> producer) {
+        stop();
+        state = std::make_shared<State>();
+        state->wakeFd = wakeFd;
+        active = true;
+        std::shared_ptr<State> shared = state;
+        worker = std::thread([shared, producer]() {
+            Sink sink = [shared](const char *data, size_t size) {
+                std::unique_lock<std::mutex> lock(shared->mutex);
+                // Don't run far ahead of the editor, the text would sit in memory twice.
+                shared->roomLeft.wait(lock, [&shared]() {
+                    return shared->queued < maxQueued || shared->stopping.load(std::memory_order_relaxed);
+                });
+                shared->pending.emplace_back(data, size);
+                shared->queued += size;
+                shared->wake();
+                return !shared->stopping.load(std::memory_order_relaxed);
+            };
+            bool ok = producer(sink);
+            std::lock_guard<std::mutex> lock(shared->mutex);
+            shared->failed = !ok && !shared->stopping;
+            shared->finished = true;
+            shared->wake();
+        });
+    }
+
+    void start(int fd) {
+        start([fd](const Sink &sink) {
+            std::vector<char> buffer(1 << 16);
+            ssize_t got;
+            while ((got = read(fd, buffer.data(), buffer.size())) != 0) {
+                if (got < 0) {
+                    if (errno == EINTR) continue;
+                    break;
+                }
+                if (!sink(buffer.data(), got)) break;
+            }
+            close(fd);
+            return got >= 0;
+        });
+    }
+
+    // The thread may be stuck in read() on a quiet pipe, so it is let go rather
+    // than waited for. It only touches the shared state, never this object.
+    void stop() {
+        if (state) {
+            std::lock_guard<std::mutex> lock(state->mutex);
+            state->stopping = true;
+            state->roomLeft.notify_all();
+        }
+        if (worker.joinable()) {
+            worker.detach();
+        }
+        active = false;
+    }
+
+    bool running() const {
+        return active;
+    }
+
+    // True if the stream ended with an error (a broken compressed file).
+    bool failed() const {
+        return failedAtEnd;
+    }
+
+    // Hands over about limit bytes of what has been read, so a fast producer
+    // can't keep the editor busy for long. Returns false once the stream has
+    // ended and everything has been handed over.
+    bool take(std::string &out, size_t limit) {
+        out.clear();
+        if (!active) {
+            return false;
+        }
+        std::lock_guard<std::mutex> lock(state->mutex);
+        while (!state->pending.empty() && out.size() < limit) {
+            out += state->pending.front();
+            state->queued -= state->pending.front().size();
+            state->pending.pop_front();
+        }
+        state->roomLeft.notify_all();
+        if (state->finished && state->pending.empty() && out.empty()) {
+            active = false;
+            failedAtEnd = state->failed;
+        }
+        return active;
+    }
+
+    // True if there is more waiting than the last take handed over.
+    bool hasMore() {
+        if (!active) {
+            return false;
+        }
+        std::lock_guard<std::mutex> lock(state->mutex);
+        return !state->pending.empty() || state->finished;
+    }
+
+private:
+    static const size_t maxQueued = 32 << 20;
+
+    struct State {
+        std::mutex mutex;
+        std::condition_variable roomLeft;
+        std::deque<std::string> pending;
+        size_t queued = 0;
+        bool finished = false, failed = false;
+        std::atomic<bool> stopping{false};
+        int wakeFd = -1;
+
+        void wake() {
+            if (wakeFd >= 0) {
+                uint64_t one = 1;
+                write(wakeFd, &one, sizeof(one));
+            }
+        }
+    };
+    std::shared_ptr<State> state;
+    std::thread worker;
+    int wakeFd = -1;
+    bool active = false, failedAtEnd = false; // Only used by the main thread.
+};
+
+// A fixed size queue for exactly one thread putting things in and one taking
+// them out. No locks: each side only writes its own index, the other side just
+// reads it.
+template <typename T, size_t Size>
+class SpscRing {
+public:
+    bool push(const T &item) {
+        size_t head = headIndex.load(std::memory_order_relaxed);
+        if (head - tailIndex.load(std::memory_order_acquire) == Size) {
+            return false; // Full.
+        }
+        items[head % Size] = item;
+        headIndex.store(head + 1, std::memory_order_release);
+        return true;
+    }
+
+    bool pop(T &item) {
+        size_t tail = tailIndex.load(std::memory_order_relaxed);
+        if (tail == headIndex.load(std::memory_order_acquire)) {
+            return false;
+        }
+        item = items[tail % Size];
+        tailIndex.store(tail + 1, std::memory_order_release);
+        return true;
+    }
+
+    bool empty() const {
+        return tailIndex.load(std::memory_order_acquire) == headIndex.load(std::memory_order_acquire);
+    }
+
+private:
+    std::array<T, Size> items;
+    alignas(64) std::atomic<size_t> headIndex{0}; // Only the producer writes it.
+    alignas(64) std::atomic<size_t> tailIndex{0}; // Only the consumer writes it.
+};
+
+// Reads the keyboard on a thread of its own, so keys are taken off the tty the
+// moment they arrive even while the editor is busy drawing or saving. They are
+// turned into the same codes getch gives (KEY_UP and so on) using the
+// terminal's key sequences, which ncurses is asked for once on the main thread;
+// ncurses itself is never touched from the reader.
+class KeyInput {
+public:
+    struct Key {
+        int code;
+        std::chrono::steady_clock::time_point arrived; // When the bytes came off the tty.
+    };
+
+    ~KeyInput() {
+        stop();
+    }
+
+    // Call after initscr and keypad.
+    void start(int fd) {
+        for (int code = KEY_MIN; code < KEY_MIN + 1024; code++) {
+            for (int count = 0;; count++) {
+                char *sequence = keybound(code, count);
+                if (!sequence) break;
+                sequences[sequence] = code;
+                longest = std::max(longest, strlen(sequence));
+                free(sequence);
+            }
+        }
+        escapeDelay = ESCDELAY;
+        wakeFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        stopFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        ttyFd = fd;
+        reader = std::thread(&KeyInput::readLoop, this);
+    }
+
+    void stop() {
+        if (reader.joinable()) {
+            uint64_t one = 1;
+            write(stopFd, &one, sizeof(one));
+            reader.join();
+            close(wakeFd);
+            close(stopFd);
+        }
+    }
+
+    bool pop(Key &key) {
+        return ring.pop(key);
+    }
+
+    bool pending() const {
+        return !ring.empty();
+    }
+
+    // Readable after keys were added, clearWake makes it quiet again.
+    int descriptor() const {
+        return wakeFd;
+    }
+
+    void clearWake() {
+        uint64_t count;
+        read(wakeFd, &count, sizeof(count));
+    }
+
+private:
+    void wake() {
+        uint64_t one = 1;
+        write(wakeFd, &one, sizeof(one));
+    }
+
+    void readLoop() {
+        std::string bytes;
+        std::chrono::steady_clock::time_point arrived;
+        char buffer[256];
+        while (true) {
+            struct pollfd fds[2] = {{ttyFd, POLLIN, 0}, {stopFd, POLLIN, 0}};
+            // Half a key sequence waits ESCDELAY for the rest, then counts as typed keys (Escape on its own).
+            int ready = poll(fds, 2, bytes.empty() ? -1 : escapeDelay);
+            if (ready < 0 && errno == EINTR) continue;
+            if (ready < 0 || (fds[1].revents & POLLIN)) return;
+            if (ready == 0) {
+                decode(bytes, arrived, true);
+                continue;
+            }
+            ssize_t got = read(ttyFd, buffer, sizeof(buffer));
+            if (got < 0 && (errno == EINTR || errno == EAGAIN)) continue;
+            if (got <= 0) return; // The terminal is gone.
+            arrived = std::chrono::steady_clock::now();
+            bytes.append(buffer, got);
+            decode(bytes, arrived, false);
+        }
+    }
+
+    // Takes whole keys off the front of bytes, leaving the start of a sequence
+    // that may still be coming unless flush is set.
+    void decode(std::string &bytes, std::chrono::steady_clock::time_point arrived, bool flush) {
+        while (!bytes.empty()) {
+            auto next = sequences.lower_bound(bytes);
+            if (!flush && next != sequences.end() && next->first.size() > bytes.size() &&
+                next->first.compare(0, bytes.size(), bytes) == 0) {
+                return; // Could still become a longer key.
+            }
+            int code = (unsigned char)bytes[0];
+            size_t used = 1;
+            for (size_t length = std::min(bytes.size(), longest); length > 1; length--) {
+                auto found = sequences.find(bytes.substr(0, length));
+                if (found != sequences.end()) {
+                    code = found->second;
+                    used = length;
+                    break;
+                }
+            }
+            if (used == 1) {
+                auto found = sequences.find(bytes.substr(0, 1));
+                if (found != sequences.end()) {
+                    code = found->second; // Backspace sends a single byte.
+                } else if (code == '\r') {
+                    code = '\n'; // Like getch does.
+                }
+            }
+            bytes.erase(0, used);
+            while (!ring.push({code, arrived})) {
+                std::this_thread::sleep_for(std::chrono::milliseconds(1)); // Full, never drop a key.
+            }
+            wake();
+        }
+    }
+
+    std::map<std::string, int> sequences; // Written before the reader starts, only read after.
+    size_t longest = 0;
+    int escapeDelay = 1000;
+    int ttyFd = -1, wakeFd = -1, stopFd = -1;
+    SpscRing<Key, 1024> ring;
+    std::thread reader;
+};
+
+// What goes on the line above the status bar: messages that go away by
+// themselves after a few seconds, and one progress line per background job
+// that stays until the job says it's done. Nothing here waits for a key, and
+// any thread may post.
+class StatusMessages {
+public:
+    enum Severity { INFO, WARNING, ERROR };
+    using Clock = std::chrono::steady_clock;
+
+    // An eventfd poked on every post, so the editor loop draws it.
+    void wakeOnPost(int fd) {
+        wakeFd = fd;
+    }
+
+    void post(const std::string &text, Severity severity) {
+        static const int seconds[] = {3, 5, 8}; // Errors stay longest.
+        std::lock_guard<std::mutex> lock(mutex);
+        messages.push_back({text, severity, Clock::now() + std::chrono::seconds(seconds[severity])});
+        if (messages.size() > 8) {
+            messages.pop_front();
+        }
+        wake();
+    }
+
+    // Sets what job shows, an empty text takes it off.
+    void progress(const std::string &job, const std::string &text) {
+        std::lock_guard<std::mutex> lock(mutex);
+        auto found = std::find_if(jobs.begin(), jobs.end(), [&job](const std::pair<std::string, std::string> &entry) {
+            return entry.first == job;
+        });
+        if (found == jobs.end() ? text.empty() : found->second == text) {
+            return; // Nothing new.
+        }
+        if (text.empty()) {
+            jobs.erase(found);
+        } else if (found != jobs.end()) {
+            found->second = text;
+        } else {
+            jobs.emplace_back(job, text);
+        }
+        wake();
+    }
+
+    // The newest message, the number of older ones still showing, then every
+    // job's progress. severity is the worst of them.
+    std::string line(Severity &severity) {
+        std::lock_guard<std::mutex> lock(mutex);
+        std::string text;
+        severity = INFO;
+        if (!messages.empty()) {
+            text = messages.back().text;
+            if (messages.size() > 1) {
+                text += " (+" + std::to_string(messages.size() - 1) + ")";
+            }
+            for (const auto &message : messages) {
+                severity = std::max(severity, message.severity);
+            }
+        }
+        for (const auto &job : jobs) {
+            text += (text.empty() ? "" : " | ") + job.second;
+        }
+        return text;
+    }
+
+    // Drops what has been up long enough, true if anything went.
+    bool expire() {
+        std::lock_guard<std::mutex> lock(mutex);
+        auto now = Clock::now();
+        size_t before = messages.size();
+        messages.erase(std::remove_if(messages.begin(), messages.end(), [now](const Message &message) {
+            return message.expires <= now;
+        }), messages.end());
+        return messages.size() != before;
+    }
+
+    // -1 if nothing is waiting to expire.
+    long long msUntilExpiry() {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (messages.empty()) {
+            return -1;
+        }
+        auto first = messages.front().expires;
+        for (const auto &message : messages) {
+            first = std::min(first, message.expires);
+        }
+        return std::max<long long>(0, std::chrono::duration_cast<std::chrono::milliseconds>(first - Clock::now()).count());
+    }
+
+private:
+    struct Message {
+        std::string text;
+        Severity severity;
+        Clock::time_point expires;
+    };
+
+    void wake() {
+        if (wakeFd >= 0) {
+            uint64_t one = 1;
+            write(wakeFd, &one, sizeof(one));
+        }
+    }
+
+    std::mutex mutex;
+    std::deque<Message> messages; // Oldest first.
+    std::vector<std::pair<std::string, std::string>> jobs;
+    int wakeFd = -1;
+};
+
+// The one place the editor sleeps, until there is something to do: a key, a
+// signal, a timer running out, the file changing on disk or a background job
+// having news. Keys and signals sit in an epoll of their own, so a prompt can
+// wait for a key without being woken by everything else.
+class EventLoop {
+public:
+    enum Source {
+        KEYS = 1,
+        DISK = 2,           // The file watcher has events.
+        JOBS = 4,           // A save finished, or a stream or paste has data.
+        AUTOSAVE_TIMER = 8,
+        DEADLINE_TIMER = 16, // A clipboard program ran out of time.
+        CLOCK_TIMER = 32,    // The next second for the Ctrl+T clock.
+        STATUS_TIMER = 64,   // A status message is due to go.
+        RESIZE_TIMER = 128,  // A burst of resizes has settled.
+    };
+    static const int timerCount = 5;
+
+    ~EventLoop() {
+        for (int fd : {keysPoll, allPoll, signalFd, jobsFd, timerFds[0], timerFds[1], timerFds[2], timerFds[3], timerFds[4]}) {
+            if (fd >= 0) close(fd);
+        }
+    }
+
+    // The signals have to be blocked in every thread already, they're read from a signalfd.
+    void start(int keysFd, const sigset_t &signals) {
+        keysPoll = epoll_create1(EPOLL_CLOEXEC);
+        allPoll = epoll_create1(EPOLL_CLOEXEC);
+        signalFd = signalfd(-1, &signals, SFD_NONBLOCK | SFD_CLOEXEC);
+        jobsFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        add(keysPoll, keysFd, KEYS);
+        add(keysPoll, signalFd, KEYS);
+        add(allPoll, keysPoll, KEYS);
+        add(allPoll, jobsFd, JOBS);
+        for (int i = 0; i < timerCount; i++) {
+            timerFds[i] = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+            add(allPoll, timerFds[i], AUTOSAVE_TIMER << i);
+        }
+    }
+
+    // Background threads poke this eventfd when they have something.
+    int jobsDescriptor() const {
+        return jobsFd;
+    }
+
+    // The watcher's inotify fd. It's new after every watch(), a closed one
+    // leaves the epoll by itself, so adding again is all it takes.
+    void watchDisk(int fd) {
+        if (fd >= 0) {
+            add(allPoll, fd, DISK);
+        }
+    }
+
+    // Goes off once, ms from now. -1 turns it off.
+    void setTimer(Source timer, long long ms) {
+        struct itimerspec when = {};
+        if (ms >= 0) {
+            when.it_value.tv_sec = ms / 1000;
+            when.it_value.tv_nsec = (ms % 1000) * 1000000 + 1; // All zero would mean off.
+        }
+        timerfd_settime(timerFds[timerIndex(timer)], 0, &when, nullptr);
+    }
+
+    // Sleeps until something happens or waitMs (-1 for ever) passes. Returns
+    // the sources that went off, keys are left for the key reader.
+    unsigned wait(int waitMs) {
+        struct epoll_event events[8];
+        int count = epoll_wait(allPoll, events, 8, waitMs);
+        unsigned fired = 0;
+        for (int i = 0; i < count; i++) {
+            unsigned source = events[i].data.u32;
+            fired |= source;
+            uint64_t drained;
+            if (source == JOBS) {
+                read(jobsFd, &drained, sizeof(drained));
+            } else if (source >= AUTOSAVE_TIMER) {
+                read(timerFds[timerIndex((Source)source)], &drained, sizeof(drained));
+            }
+        }
+        return fired;
+    }
+
+    // Waits for a key or a signal only.
+    bool waitForKeys(int waitMs) {
+        struct epoll_event event;
+        int count;
+        while ((count = epoll_wait(keysPoll, &event, 1, waitMs)) < 0 && errno == EINTR) {}
+        return count > 0;
+    }
+
+    // The next signal that came in, 0 if none.
+    int takeSignal() {
+        struct signalfd_siginfo info;
+        if (read(signalFd, &info, sizeof(info)) != sizeof(info)) {
+            return 0;
+        }
+        return info.ssi_signo;
+    }
+
+private:
+    static void add(int poll, int fd, unsigned source) {
+        struct epoll_event event = {};
+        event.events = EPOLLIN;
+        event.data.u32 = source;
+        epoll_ctl(poll, EPOLL_CTL_ADD, fd, &event);
+    }
+
+    static int timerIndex(Source timer) {
+        return timer == AUTOSAVE_TIMER ? 0 : timer == DEADLINE_TIMER ? 1 : timer == CLOCK_TIMER ? 2 :
+               timer == STATUS_TIMER ? 3 : 4;
+    }
+
+    int keysPoll = -1, allPoll = -1, signalFd = -1, jobsFd = -1;
+    int timerFds[timerCount] = {-1, -1, -1, -1, -1};
+};
+
+// Counts words a piece at a time, for text that arrives in chunks. A word is
+// anything between spaces with at least one letter or number in it, so on
+// their own !, . and ? are not words.
+struct WordCounter {
+    uint64_t count = 0;
+    bool inWord = false, wordHasText = false;
+
+    void feed(const char *text, size_t size) {
+        for (size_t i = 0; i < size; i++) {
+            unsigned char c = text[i];
+            if (isspace(c)) {
+                count += (inWord && wordHasText);
+                inWord = wordHasText = false;
+            } else {
+                inWord = true;
+                wordHasText = wordHasText || !ispunct(c);
+            }
+        }
+    }
+
+    uint64_t finish() {
+        count += (inWord && wordHasText);
+        inWord = wordHasText = false;
+        return count;
+    }
+};
+
+// A version of the text that other threads can read while the editor keeps
+// typing into its own copy. The lines are kept in blocks that never change once
+// published, so the next version shares every block the edits did not touch and
+// only copies the rest.
+class TextSnapshot {
+public:
+    struct Block {
+        std::vector<std::string> lines;
+        mutable std::atomic<int64_t> words{-1}; // Counted by whoever needs it first.
+
+        uint64_t wordCount() const {
+            int64_t known = words.load(std::memory_order_relaxed);
+            if (known < 0) {
+                WordCounter counter;
+                for (const auto &line : lines) {
+                    counter.feed(line.data(), line.size());
+                    counter.finish(); // Words never run across lines.
+                }
+                known = counter.count;
+                words.store(known, std::memory_order_relaxed);
+            }
+            return known;
+        }
+    };
+
+    // Walks the lines in order, so a snapshot can go wherever a vector of lines can.
+    class Iterator {
+    public:
+        using iterator_category = std::forward_iterator_tag;
+        using value_type = std::string;
+        using difference_type = std::ptrdiff_t;
+        using pointer = const std::string *;
+        using reference = const std::string &;
+
+        Iterator(const TextSnapshot *text, size_t block, size_t line) : text(text), block(block), line(line) {}
+
+        const std::string &operator*() const {
+            return text->blocks[block]->lines[line];
+        }
+
+        Iterator &operator++() {
+            if (++line == text->blocks[block]->lines.size()) {
+                block++;
+                line = 0;
+            }
+            return *this;
+        }
+
+        bool operator==(const Iterator &other) const {
+            return block == other.block && line == other.line;
+        }
+
+        bool operator!=(const Iterator &other) const {
+            return !(*this == other);
+        }
+
+    private:
+        const TextSnapshot *text;
+        size_t block, line;
+    };
+
+    static const size_t blockLines = 1024;
+
+    uint64_t number = 0; // Goes up with every version published.
+    std::vector<std::shared_ptr<const Block>> blocks; // Never empty ones.
+    std::vector<size_t> starts; // The first line of each block.
+    size_t lineCount = 0;
+
+    size_t size() const {
+        return lineCount;
+    }
+
+    Iterator begin() const {
+        return Iterator(this, 0, 0);
+    }
+
+    Iterator end() const {
+        return Iterator(this, blocks.size(), 0);
+    }
+
+    // Starts at line index, end() past the last one.
+    Iterator lineAt(size_t index) const {
+        if (index >= lineCount) {
+            return end();
+        }
+        size_t block = std::upper_bound(starts.begin(), starts.end(), index) - starts.begin() - 1;
+        return Iterator(this, block, index - starts[block]);
+    }
+
+    // The blocks are counted in parallel. Once cancel is set the rest are
+    // skipped and the total is no use.
+    uint64_t wordCount(const ThreadPool::CancelToken &cancel = nullptr) const {
+        std::atomic<uint64_t> total{0};
+        ThreadPool::shared().parallelFor(blocks.size(), [this, &total](size_t i) {
+            total += blocks[i]->wordCount();
+        }, cancel, ThreadPool::BACKGROUND);
+        return total;
+    }
+
+    // Every place needle is, as (line, byte) in order. The blocks are searched in
+    // parallel, once cancel is set the rest are skipped and what comes back is no use.
+    std::vector<std::pair<int, size_t>> findAll(const std::string &needle, const ThreadPool::CancelToken &cancel = nullptr) const {
+        std::vector<std::vector<std::pair<int, size_t>>> found(blocks.size());
+        ThreadPool::shared().parallelFor(blocks.size(), [this, &found, &needle](size_t i) {
+            const std::vector<std::string> &lines = blocks[i]->lines;
+            for (size_t j = 0; j < lines.size(); j++) {
+                size_t pos = 0;
+                while ((pos = lines[j].find(needle, pos)) != std::string::npos) {
+                    found[i].emplace_back(starts[i] + j, pos);
+                    pos += needle.size();
+                }
+            }
+        }, cancel);
+        std::vector<std::pair<int, size_t>> matches;
+        for (auto &blockMatches : found) {
+            matches.insert(matches.end(), blockMatches.begin(), blockMatches.end());
+        }
+        return matches;
+    }
+
+    // The next version after previous. Lines before changedFrom are the same unless
+    // they are in dirty, from changedFrom on lines may have come, gone or changed.
+    // Blocks on the end that still match the text are kept wherever they moved to.
+    static std::unique_ptr<TextSnapshot> update(const TextSnapshot &previous, const std::vector<std::string> &lines,
+                                                const std::set<int> &dirty, int changedFrom) {
+        auto next = std::make_unique<TextSnapshot>();
+        size_t line = 0;
+        auto dirtyLine = dirty.begin();
+        for (size_t i = 0; i < previous.blocks.size(); i++) {
+            size_t start = previous.starts[i], end = start + previous.blocks[i]->lines.size();
+            if (end > (size_t)changedFrom || end > lines.size()) {
+                break;
+            }
+            while (dirtyLine != dirty.end() && (size_t)*dirtyLine < start) {
+                dirtyLine++;
+            }
+            if (dirtyLine != dirty.end() && (size_t)*dirtyLine < end) {
+                next->add(lines, start, end);
+            } else {
+                next->add(previous.blocks[i]);
+            }
+            line = end;
+        }
+
+        // Comparing is cheaper than copying, so after an Enter near the top most
+        // of the file is still shared.
+        std::vector<std::shared_ptr<const Block>> tail; // Back to front.
+        size_t tailStart = lines.size();
+        long shift = (long)lines.size() - (long)previous.lineCount;
+        for (size_t i = previous.blocks.size(); i-- > 0 && line < tailStart;) {
+            const Block &block = *previous.blocks[i];
+            long start = (long)previous.starts[i] + shift;
+            if (start < (long)line || !std::equal(block.lines.begin(), block.lines.end(), lines.begin() + start)) {
+                break;
+            }
+            tail.push_back(previous.blocks[i]);
+            tailStart = start;
+        }
+        // A sliver between two kept blocks takes the next one along, so blocks don't
+        // get smaller and smaller with every edit.
+        if (tailStart - line < blockLines / 2 && tailStart > line && !tail.empty()) {
+            tailStart += tail.back()->lines.size();
+            tail.pop_back();
+        }
+
+        size_t pieces = std::max<size_t>(1, (tailStart - line + blockLines / 2) / blockLines);
+        for (size_t piece = 0; line < tailStart; piece++) {
+            size_t end = line + (tailStart - line) / (pieces - piece);
+            next->add(lines, line, end);
+            line = end;
+        }
+        for (auto block = tail.rbegin(); block != tail.rend(); ++block) {
+            next->add(*block);
+        }
+        return next;
+    }
+
+private:
+    void add(std::shared_ptr<const Block> block) {
+        starts.push_back(lineCount);
+        lineCount += block->lines.size();
+        blocks.push_back(std::move(block));
+    }
+
+    void add(const std::vector<std::string> &lines, size_t from, size_t to) {
+        auto block = std::make_shared<Block>();
+        block->lines.assign(lines.begin() + from, lines.begin() + to);
+        add(std::move(block));
+    }
+};
+
+// Hands the newest TextSnapshot to any number of reader threads. Readers take no
+// locks and never hold up the editor: each one notes the epoch it started in,
+// and a replaced version is only freed once every reader that could still see
+// it is done (epoch based reclamation). Publishing and freeing happen on the
+// editor thread.
+class SnapshotStore {
+public:
+    // The newest version when it was made, readable until it goes away.
+    class Reader {
+    public:
+        explicit Reader(SnapshotStore &store) : slot(store.enter()), snapshot(store.current.load()) {}
+
+        Reader(Reader &&other) noexcept : slot(other.slot), snapshot(other.snapshot) {
+            other.slot = nullptr;
+        }
+
+        Reader(const Reader &) = delete;
+        Reader &operator=(const Reader &) = delete;
+
+        ~Reader() {
+            if (slot) {
+                slot->store(0, std::memory_order_release);
+            }
+        }
+
+        const TextSnapshot &text() const {
+            return *snapshot;
+        }
+
+    private:
+        std::atomic<uint64_t> *slot;
+        const TextSnapshot *snapshot;
+    };
+
+    SnapshotStore() : current(new TextSnapshot()) {}
+
+    ~SnapshotStore() {
+        for (auto &old : retired) {
+            delete old.second;
+        }
+        delete current.load();
+    }
+
+    SnapshotStore(const SnapshotStore &) = delete;
+    SnapshotStore &operator=(const SnapshotStore &) = delete;
+
+    // Editor thread only, like publish.
+    const TextSnapshot &latest() const {
+        return *current.load(std::memory_order_relaxed);
+    }
+
+    void publish(std::unique_ptr<TextSnapshot> next) {
+        next->number = latest().number + 1;
+        const TextSnapshot *old = current.exchange(next.release());
+        retired.emplace_back(epoch.fetch_add(1), old);
+        collect();
+    }
+
+    // Frees the versions no reader can be looking at any more.
+    void collect() {
+        uint64_t oldest = UINT64_MAX;
+        for (auto &slot : slots) {
+            uint64_t started = slot.epoch.load();
+            if (started != 0) {
+                oldest = std::min(oldest, started);
+            }
+        }
+        auto stillRead = std::remove_if(retired.begin(), retired.end(), [oldest](const std::pair<uint64_t, const TextSnapshot *> &old) {
+            if (old.first < oldest) {
+                delete old.second;
+                return true;
+            }
+            return false;
+        });
+        retired.erase(stillRead, retired.end());
+    }
+
+private:
+    struct Slot {
+        alignas(64) std::atomic<uint64_t> epoch{0}; // 0 while nobody uses it.
+    };
+
+    // The epoch is noted before the snapshot is loaded. A version retired in that
+    // epoch or later stays until the slot is cleared, and one retired before it
+    // was already replaced, so the load can't return it.
+    std::atomic<uint64_t> *enter() {
+        while (true) {
+            uint64_t now = epoch.load();
+            for (auto &slot : slots) {
+                uint64_t idle = 0;
+                if (slot.epoch.load(std::memory_order_relaxed) == 0 && slot.epoch.compare_exchange_strong(idle, now)) {
+                    return &slot.epoch;
+                }
+            }
+            std::this_thread::yield(); // More readers than slots, wait for one to finish.
+        }
+    }
+
+    std::atomic<const TextSnapshot *> current;
+    std::atomic<uint64_t> epoch{1};
+    std::array<Slot, 64> slots;
+    std::vector<std::pair<uint64_t, const TextSnapshot *>> retired; // With the epoch they were replaced in.
+};
+
+// --self-test-snapshots command: one thread edits and publishes while the others
+// read every version they can get. Every line is "<number> x" and the numbers
+// always add up to 0, so a reader that sees a torn or freed version notices.
+// Most useful in a -fsanitize=thread build, see the README.
+int SelfTestSnapshots(int argc, char *argv[], int i) {
+    int seconds = 10;
+    if (i + 1 < argc) {
+        seconds = std::max(1, atoi(argv[i + 1]));
+    }
+    const size_t lineCount = 20000;
+    std::vector<std::string> lines(lineCount, "0 x");
+    std::vector<long> values(lineCount, 0);
+    SnapshotStore store;
+    store.publish(TextSnapshot::update(store.latest(), lines, {}, 0));
+
+    std::atomic<bool> stop{false};
+    std::atomic<uint64_t> reads{0}, problems{0};
+    auto check = [&]() {
+        while (!stop.load()) {
+            SnapshotStore::Reader reader(store);
+            const TextSnapshot &text = reader.text();
+            long sum = 0;
+            size_t seen = 0;
+            for (const auto &line : text) {
+                sum += atol(line.c_str());
+                seen++;
+            }
+            size_t middle = text.lineCount / 2;
+            bool ok = sum == 0 && seen == text.lineCount && text.wordCount() == 2 * seen &&
+                      (seen == 0 || *text.lineAt(middle) == *std::next(text.begin(), middle));
+            if (!ok) {
+                problems++;
+            }
+            reads++;
+        }
+    };
+    std::vector<std::thread> readers;
+    for (unsigned n = 0; n < std::max(3u, std::thread::hardware_concurrency()); n++) {
+        readers.emplace_back(check);
+    }
+
+    // Moves amounts between lines in place, and adds and removes lines, so both
+    // the dirty lines and the rebuilt tail of update are used.
+    std::mt19937 random(12345);
+    uint64_t published = 0;
+    auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(seconds);
+    while (std::chrono::steady_clock::now() < deadline) {
+        std::set<int> dirty;
+        int changedFrom = INT_MAX;
+        size_t a = random() % lines.size(), b = random() % lines.size();
+        switch (random() % 3) {
+            case 0: {
+                long amount = (long)(random() % 1000);
+                values[a] += amount;
+                values[b] -= amount;
+                dirty = {(int)a, (int)b};
+                break;
+            }
+            case 1: // A new line of 0.
+                if (lines.size() < 2 * lineCount) {
+                    values.insert(values.begin() + a, 0);
+                    lines.insert(lines.begin() + a, "0 x");
+                    changedFrom = a;
+                }
+                break;
+            default: // Line a goes, what it held moves to line b.
+                if (lines.size() > lineCount / 2 && a != b) {
+                    values[b] += values[a];
+                    values.erase(values.begin() + a);
+                    lines.erase(lines.begin() + a);
+                    changedFrom = a;
+                    dirty = {(int)(b > a ? b - 1 : b)};
+                }
+                break;
+        }
+        for (int y : dirty) {
+            lines[y] = std::to_string(values[y]) + " x";
+        }
+        store.publish(TextSnapshot::update(store.latest(), lines, dirty, changedFrom));
+        published++;
+        if (published % 1000 == 0 && !std::equal(lines.begin(), lines.end(), store.latest().begin(), store.latest().end())) {
+            problems++; // The newest version must be exactly the text.
+        }
+    }
+    stop = true;
+    for (auto &reader : readers) {
+        reader.join();
+    }
+    store.collect();
+
+    std::cout << "Published " << published << " versions, " << readers.size() << " readers checked " << reads << " of them\n";
+    if (problems > 0) {
+        std::cerr << "Error: " << problems << " versions were wrong! :(\n";
+        return 1;
+    }
+    std::cout << "Every version was whole. :)\n";
+    return 0;
+}
+
+// Finding every line in a huge file means reading all of it, so the result is
+// kept in $XDG_CACHE_HOME/nemos and the next open of the same file skips that.
+// The cache holds where every 1024th line starts and how many words each of
+// those blocks has. It's only made for big files.
+static const uint64_t lineCacheMinSize = 64 << 20;
+static const uint64_t lineCacheLinesPerMark = 1024;
+static const char lineCacheMagic[8] = {'N', 'E', 'M', 'O', 'S', 'I', '0', '1'};
+
+struct LineCacheHeader {
+    char magic[8];
+    uint64_t device, inode, size, mtimeSec, mtimeNsec;
+    uint64_t sampleHash; // A few pieces of the file, in case it changed without touching mtime.
+    uint64_t linesPerMark, markCount, totalLines;
+};
+
+struct LineCache {
+    std::vector<uint64_t> marks; // marks[k] is where line k * lineCacheLinesPerMark starts.
+    std::vector<uint32_t> blockWords; // Words in the lines from marks[k] up to marks[k + 1].
+    uint64_t totalLines = 0;
+};
+
+std::string lineCachePath(const struct stat &info) {
+    const char *base = getenv("XDG_CACHE_HOME");
+    std::string dir;
+    if (base && base[0] == '/') {
+        dir = std::string(base) + "/nemos";
+    } else if (getenv("HOME")) {
+        dir = std::string(getenv("HOME")) + "/.cache/nemos";
+    } else {
+        return "";
+    }
+    return dir + "/" + std::to_string((uint64_t)info.st_dev) + "-" + std::to_string((uint64_t)info.st_ino) + ".lines";
+}
+
+// Hashes 16 pieces of 4 KB spread over the file. Cheap even for huge files.
+uint64_t sampleFileHash(int fd, uint64_t size) {
+    uint64_t hash = hashBytes(nullptr, 0);
+    char sample[4096];
+    for (int i = 0; i < 16; i++) {
+        uint64_t offset = size > sizeof(sample) ? (size - sizeof(sample)) / 15 * i : 0;
+        ssize_t got = pread(fd, sample, sizeof(sample), offset);
+        if (got > 0) {
+            hash = hashBytes(sample, got, hash);
+        }
+    }
+    return hash;
+}
+
+// Reads the cache for the file open on fd. A cache that is stale or broken is
+// deleted and false returned, the caller then counts the lines itself.
+bool loadLineCache(int fd, LineCache &cache) {
+    struct stat info;
+    if (fstat(fd, &info) != 0 || (uint64_t)info.st_size < lineCacheMinSize) {
+        return false;
+    }
+    std::string path = lineCachePath(info);
+    int cacheFd = path.empty() ? -1 : open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (cacheFd < 0) {
+        return false;
+    }
+    struct stat cacheInfo;
+    void *mapped = MAP_FAILED;
+    if (fstat(cacheFd, &cacheInfo) == 0 && (size_t)cacheInfo.st_size >= sizeof(LineCacheHeader) + sizeof(uint64_t)) {
+        mapped = mmap(nullptr, cacheInfo.st_size, PROT_READ, MAP_PRIVATE, cacheFd, 0);
+    }
+    close(cacheFd);
+    if (mapped == MAP_FAILED) {
+        unlink(path.c_str());
+        return false;
+    }
+
+    const char *bytes = static_cast<const char *>(mapped);
+    size_t length = cacheInfo.st_size;
+    LineCacheHeader header;
+    memcpy(&header, bytes, sizeof(header));
+    // Cheap checks first, the checksum and the samples only if those pass.
+    bool valid = memcmp(header.magic, lineCacheMagic, sizeof(lineCacheMagic)) == 0 &&
+                 header.device == (uint64_t)info.st_dev && header.inode == (uint64_t)info.st_ino &&
+                 header.size == (uint64_t)info.st_size && header.mtimeSec == (uint64_t)info.st_mtim.tv_sec &&
+                 header.mtimeNsec == (uint64_t)info.st_mtim.tv_nsec && header.linesPerMark == lineCacheLinesPerMark &&
+                 header.markCount > 0 && header.markCount < length &&
+                 length == sizeof(header) + header.markCount * (sizeof(uint64_t) + sizeof(uint32_t)) + sizeof(uint64_t);
+    if (valid) {
+        uint64_t checksum;
+        memcpy(&checksum, bytes + length - sizeof(checksum), sizeof(checksum));
+        valid = hashBytes(bytes, length - sizeof(checksum)) == checksum && sampleFileHash(fd, info.st_size) == header.sampleHash;
+    }
+    if (valid) {
+        const char *at = bytes + sizeof(header);
+        cache.marks.resize(header.markCount);
+        memcpy(cache.marks.data(), at, header.markCount * sizeof(uint64_t));
+        at += header.markCount * sizeof(uint64_t);
+        cache.blockWords.resize(header.markCount);
+        memcpy(cache.blockWords.data(), at, header.markCount * sizeof(uint32_t));
+        cache.totalLines = header.totalLines;
+    }
+    munmap(mapped, length);
+    if (!valid) {
+        unlink(path.c_str());
+    }
+    return valid;
+}
+
+// Writes the cache for the file open on fd, through a temp file so a reader
+// never sees half of it.
+void saveLineCache(int fd, const LineCache &cache) {
+    struct stat info;
+    if (fstat(fd, &info) != 0 || (uint64_t)info.st_size < lineCacheMinSize || cache.marks.size() != cache.blockWords.size()) {
+        return;
+    }
+    std::string path = lineCachePath(info);
+    if (path.empty()) {
+        return;
+    }
+    std::string dir = path.substr(0, path.find_last_of('/'));
+    mkdir(dir.substr(0, dir.find_last_of('/')).c_str(), 0700); // ~/.cache might not be there yet.
+    mkdir(dir.c_str(), 0700);
+
+    LineCacheHeader header = {};
+    memcpy(header.magic, lineCacheMagic, sizeof(lineCacheMagic));
+    header.device = info.st_dev;
+    header.inode = info.st_ino;
+    header.size = info.st_size;
+    header.mtimeSec = info.st_mtim.tv_sec;
+    header.mtimeNsec = info.st_mtim.tv_nsec;
+    header.sampleHash = sampleFileHash(fd, info.st_size);
+    header.linesPerMark = lineCacheLinesPerMark;
+    header.markCount = cache.marks.size();
+    header.totalLines = cache.totalLines;
+
+    std::string data(reinterpret_cast<const char *>(&header), sizeof(header));
+    data.append(reinterpret_cast<const char *>(cache.marks.data()), cache.marks.size() * sizeof(uint64_t));
+    data.append(reinterpret_cast<const char *>(cache.blockWords.data()), cache.blockWords.size() * sizeof(uint32_t));
+    uint64_t checksum = hashBytes(data.data(), data.size());
+    data.append(reinterpret_cast<const char *>(&checksum), sizeof(checksum));
+
+    std::string tempPath;
+    int out = openTempBeside(path, tempPath);
+    if (out < 0) {
+        return;
+    }
+    if (!writeAll(out, data.data(), data.size())) {
+        close(out);
+        unlink(tempPath.c_str());
+        return;
+    }
+    commitTemp(out, tempPath, path);
+}
+
+// Copied text stays in NemoS, the last 16 copies, so copying and pasting never
+// have to wait for another program. Ctrl+V pastes the newest, Alt+V asks the
+// desktop clipboard instead. Alt+Y swaps what was just pasted for the one before.
+class KillRing {
+public:
+    static const size_t slots = 16;
+
+    void push(const std::string &text) {
+        if (text.empty()) {
+            return;
+        }
+        entries.push_front(text);
+        if (entries.size() > slots) {
+            entries.pop_back();
+        }
+    }
+
+    bool empty() const {
+        return entries.empty();
+    }
+
+    size_t size() const {
+        return entries.size();
+    }
+
+    // 0 is the newest, counting wraps around to it again.
+    const std::string &at(size_t index) const {
+        return entries[index % entries.size()];
+    }
+
+private:
+    std::deque<std::string> entries;
+};
+
+bool programInPath(const std::string &name) {
+    const char *path = getenv("PATH");
+    std::istringstream dirs(path ? path : "");
+    std::string dir;
+    while (std::getline(dirs, dir, ':')) {
+        if (!dir.empty() && access((dir + "/" + name).c_str(), X_OK) == 0) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// The command that talks to the desktop's clipboard, nullptr on a headless box
+// (where xclip would sit waiting for an X server that isn't there).
+const char *systemClipboardCommand(bool paste) {
+    if (getenv("WAYLAND_DISPLAY") && programInPath(paste ? "wl-paste" : "wl-copy")) {
+        return paste ? "wl-paste --no-newline 2>/dev/null" : "wl-copy 2>/dev/null";
+    }
+    if (getenv("DISPLAY") && programInPath("xclip")) {
+        return paste ? "xclip -o -selection clipboard 2>/dev/null" : "xclip -i -selection clipboard 2>/dev/null";
+    }
+    return nullptr;
+}
+
+// How long a clipboard program gets before it is killed, NEMOS_CLIPBOARD_TIMEOUT
+// seconds (5 if not set). A stale DISPLAY or a hung clipboard owner would
+// otherwise keep it, and a paste waiting on it, around forever.
+std::chrono::milliseconds clipboardTimeout() {
+    const char *setting = getenv("NEMOS_CLIPBOARD_TIMEOUT");
+    double seconds = setting ? atof(setting) : 0;
+    return std::chrono::milliseconds(seconds > 0 ? (long long)(seconds * 1000) : 5000);
+}
+
+// Runs command with sh, fd gets the other end of a pipe to its stdin (writing)
+// or from its stdout. Unlike popen we get the pid, so it can be killed. It gets
+// a process group of its own, killing that takes whatever it started too.
+pid_t spawnWithPipe(const char *command, bool writing, int &fd) {
+    int ends[2];
+    if (pipe2(ends, O_CLOEXEC) != 0) {
+        return -1;
+    }
+    pid_t pid = fork();
+    if (pid == 0) {
+        sigset_t none;
+        sigemptyset(&none);
+        sigprocmask(SIG_SETMASK, &none, nullptr); // The editor blocks some, the program shouldn't.
+        setpgid(0, 0);
+        dup2(ends[writing ? 0 : 1], writing ? STDIN_FILENO : STDOUT_FILENO);
+        execl("/bin/sh", "sh", "-c", command, (char *)nullptr);
+        _exit(127);
+    }
+    close(ends[writing ? 0 : 1]);
+    fd = ends[writing ? 1 : 0];
+    if (pid < 0) {
+        close(fd);
+    }
+    return pid;
+}
+
+// Waits for the child to exit, killing it once the deadline has passed.
+void reapChild(pid_t pid, std::chrono::steady_clock::time_point deadline) {
+    while (waitpid(pid, nullptr, WNOHANG) == 0) {
+        if (std::chrono::steady_clock::now() >= deadline) {
+            kill(-pid, SIGKILL);
+            waitpid(pid, nullptr, 0);
+            return;
+        }
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    }
+}
+
+// Hands copied text to the desktop clipboard on a thread of its own, so the
+// editor doesn't wait for it. False if there is no desktop clipboard.
+// Copies still being handed to wl-copy or xclip. Until they are done the
+// desktop clipboard may still hold what was there before.
+std::atomic<int> systemCopiesRunning{0};
+
+bool copyToSystemClipboard(const std::string &text) {
+    const char *command = systemClipboardCommand(false);
+    if (!command) {
+        return false;
+    }
+    systemCopiesRunning++;
+    std::thread([text, command]() {
+        int fd;
+        pid_t pid = spawnWithPipe(command, true, fd);
+        if (pid < 0) {
+            systemCopiesRunning--;
+            return;
+        }
+        auto deadline = std::chrono::steady_clock::now() + clipboardTimeout();
+        fcntl(fd, F_SETFL, O_NONBLOCK);
+        size_t written = 0;
+        while (written < text.size()) {
+            auto left = std::chrono::duration_cast<std::chrono::milliseconds>(deadline - std::chrono::steady_clock::now());
+            struct pollfd ready = {fd, POLLOUT, 0};
+            if (left.count() <= 0 || poll(&ready, 1, left.count()) <= 0) {
+                break; // Not taking it, given up on.
+            }
+            ssize_t done = write(fd, text.data() + written, text.size() - written);
+            if (done < 0 && errno != EAGAIN && errno != EINTR) {
+                break;
+            }
+            written += std::max<ssize_t>(done, 0);
+        }
+        close(fd);
+        reapChild(pid, deadline);
+        systemCopiesRunning--;
+    }).detach();
+    return true;
+}
+
+std::string base64Encode(const std::string &data) {
+    static const char table[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+    std::string out;
+    out.reserve((data.size() + 2) / 3 * 4);
+    for (size_t i = 0; i < data.size(); i += 3) {
+        uint32_t chunk = (unsigned char)data[i] << 16;
+        if (i + 1 < data.size()) chunk |= (unsigned char)data[i + 1] << 8;
+        if (i + 2 < data.size()) chunk |= (unsigned char)data[i + 2];
+        out += table[(chunk >> 18) & 63];
+        out += table[(chunk >> 12) & 63];
+        out += (i + 1 < data.size()) ? table[(chunk >> 6) & 63] : '=';
+        out += (i + 2 < data.size()) ? table[chunk & 63] : '=';
+    }
+    return out;
+}
+
+// No desktop clipboard (over ssh, say): most terminals take the text with an
+// OSC 52 escape sequence and put it on the clipboard of the machine in front
+// of the user. Terminals cap how much they take, so big copies stay local.
+void copyToTerminalClipboard(const std::string &text) {
+    if (text.size() > 74994) { // 100000 bytes of base64.
+        return;
+    }
+    std::string sequence = "\033]52;c;" + base64Encode(text) + "\a";
+    writeAll(STDOUT_FILENO, sequence.data(), sequence.size());
+}
+
+// Where every 1024th line starts in a file, so a line can be found without
+// keeping all of them. A 10 GB log with 100 million lines needs under 1 MB.
+// Built in the background with pread, which doesn't count against our memory
+// the way touching mapped pages does, or taken from the line cache.
+class LineIndex {
+public:
+    static const uint64_t linesPerMark = lineCacheLinesPerMark;
+
+    ~LineIndex() {
+        stop();
+    }
+
+    void build(const std::string &path, uint64_t size) {
+        stop();
+        marks.assign(1, 0);
+        scanned = 0;
+        totalLines = 0;
+        done = false;
+        stopping = false;
+        fileSize = size;
+        words = 0;
+
+        int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+        LineCache cache;
+        if (fd >= 0 && loadLineCache(fd, cache)) {
+            close(fd);
+            marks.swap(cache.marks);
+            totalLines = cache.totalLines;
+            for (uint32_t count : cache.blockWords) {
+                words += count;
+            }
+            scanned = size;
+            done = true;
+            return;
+        }
+        if (fd >= 0) {
+            close(fd);
+        }
+        worker = std::thread(&LineIndex::scan, this, path);
+    }
+
+    void stop() {
+        stopping = true;
+        if (worker.joinable()) {
+            worker.join();
+        }
+    }
+
+    bool complete() const {
+        return done.load(std::memory_order_acquire);
+    }
+
+    // How far the scan got, 0 to 100.
+    int progress() const {
+        return fileSize ? (int)(scanned.load(std::memory_order_relaxed) * 100 / fileSize) : 100;
+    }
+
+    // Lines in the file, only known once the scan is complete.
+    uint64_t lineCount() const {
+        return totalLines;
+    }
+
+    // Words in the file, also only known once the scan is complete.
+    uint64_t wordCount() const {
+        return words;
+    }
+
+    // The closest mark at or before offset. False if the scan hasn't got there yet.
+    bool markBefore(uint64_t offset, uint64_t &line, uint64_t &markOffset) {
+        if (offset > scanned.load(std::memory_order_acquire) && !complete()) {
+            return false;
+        }
+        std::lock_guard<std::mutex> lock(mutex);
+        size_t k = std::upper_bound(marks.begin(), marks.end(), offset) - marks.begin() - 1;
+        line = k * linesPerMark;
+        markOffset = marks[k];
+        return true;
+    }
+
+    // The last mark the scan has found so far.
+    void lastMark(uint64_t &line, uint64_t &markOffset) {
+        std::lock_guard<std::mutex> lock(mutex);
+        line = (marks.size() - 1) * linesPerMark;
+        markOffset = marks.back();
+    }
+
+    // The mark for a line, for jumping to it. False if the scan hasn't got there yet.
+    bool markForLine(uint64_t wanted, uint64_t &line, uint64_t &markOffset) {
+        std::lock_guard<std::mutex> lock(mutex);
+        size_t k = wanted / linesPerMark;
+        if (k >= marks.size()) {
+            return false;
+        }
+        line = k * linesPerMark;
+        markOffset = marks[k];
+        return true;
+    }
+
+private:
+    void scan(std::string path) {
+        int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+        if (fd < 0) {
+            return;
+        }
+        posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+        std::vector<char> buffer(1 << 20);
+        std::vector<uint64_t> found;
+        LineCache cache;
+        WordCounter blockCounter;
+        uint64_t offset = 0, lines = 0;
+        char lastByte = '\n';
+        ssize_t got;
+        while (!stopping && (got = pread(fd, buffer.data(), buffer.size(), offset)) > 0) {
+            const char *p = buffer.data(), *end = p + got, *blockStart = p;
+            while ((p = static_cast<const char *>(memchr(p, '\n', end - p))) != nullptr) {
+                ++p;
+                if (++lines % linesPerMark == 0) {
+                    found.push_back(offset + (p - buffer.data()));
+                    blockCounter.feed(blockStart, p - blockStart);
+                    cache.blockWords.push_back(std::min<uint64_t>(blockCounter.finish(), UINT32_MAX));
+                    blockCounter.count = 0;
+                    blockStart = p;
+                }
+            }
+            blockCounter.feed(blockStart, end - blockStart);
+            offset += got;
+            lastByte = buffer[got - 1];
+            if (!found.empty()) {
+                std::lock_guard<std::mutex> lock(mutex);
+                marks.insert(marks.end(), found.begin(), found.end());
+                found.clear();
+            }
+            scanned.store(offset, std::memory_order_release);
+        }
+        if (!stopping) {
+            // A last line without a newline still counts.
+            totalLines = lines + (lastByte != '\n' || offset == 0 ? 1 : 0);
+            cache.blockWords.push_back(std::min<uint64_t>(blockCounter.finish(), UINT32_MAX));
+            for (uint32_t count : cache.blockWords) {
+                words += count;
+            }
+            done.store(true, std::memory_order_release);
+
+            // Next time this file opens at once. Only if it didn't change while we read it.
+            // The marks are copied under the lock and written after it, the fsyncs
+            // would hold up drawing otherwise.
+            struct stat info;
+            if (fstat(fd, &info) == 0 && (uint64_t)info.st_size == offset) {
+                {
+                    std::lock_guard<std::mutex> lock(mutex);
+                    cache.marks = marks;
+                }
+                cache.totalLines = totalLines;
+                saveLineCache(fd, cache);
+            }
+        }
+        close(fd);
+    }
+
+    std::vector<uint64_t> marks; // marks[k] is where line k * linesPerMark starts.
+    std::mutex mutex;
+    std::thread worker;
+    std::atomic<uint64_t> scanned{0};
+    std::atomic<bool> done{false}, stopping{false};
+    uint64_t totalLines = 0, fileSize = 0, words = 0;
+};
+
+// What the go to prompt understands: "120" is line 120, "50%" is half way
+// through the file and "b4096" is byte 4096 (from a stack trace, say).
+enum JumpKind { JUMP_LINE, JUMP_PERCENT, JUMP_BYTE };
+
+bool parseJump(const std::string &input, JumpKind &kind, uint64_t &value) {
+    std::string text = input;
+    kind = JUMP_LINE;
+    if (!text.empty() && (text[0] == 'b' || text[0] == 'B')) {
+        kind = JUMP_BYTE;
+        text.erase(0, 1);
+    } else if (!text.empty() && text.back() == '%') {
+        kind = JUMP_PERCENT;
+        text.pop_back();
+    }
+    if (text.empty() || text.size() > 19 || text.find_first_not_of("0123456789") != std::string::npos) {
+        return false;
+    }
+    value = std::stoull(text);
+    return kind != JUMP_PERCENT || value <= 100;
+}
+
+// nemos --view: a read only pager for files too big to edit. The file is mapped,
+// not read, and the screen is drawn straight from the mapped pages. There are
+// no lines in memory, no undo, and nothing is counted until it's needed.
+class Pager {
+public:
+    ~Pager() {
+        index.stop();
+        if (data) {
+            munmap(const_cast<char *>(data), mappedSize);
+        }
+        if (fd >= 0) {
+            close(fd);
+        }
+    }
+
+    int run(const std::string &filename) {
+        fd = open(filename.c_str(), O_RDONLY | O_CLOEXEC);
+        struct stat info;
+        if (fd < 0 || fstat(fd, &info) != 0 || !S_ISREG(info.st_mode)) {
+            std::cout << "Error: Could not open " << filename << " :(\n";
+            return 1;
+        }
+        size = mappedSize = info.st_size;
+        if (size > 0) {
+            void *mapped = mmap(nullptr, size, PROT_READ, MAP_SHARED, fd, 0);
+            if (mapped == MAP_FAILED) {
+                std::cout << "Error: Could not map " << filename << " :(\n";
+                return 1;
+            }
+            data = static_cast<const char *>(mapped);
+            // Only what is on screen gets read, no read ahead into memory.
+            madvise(mapped, size, MADV_RANDOM);
+        }
+        name = filename; // fd stays open, see clampToFile.
+        index.build(filename, size);
+
+        initscr();
+        raw();
+        keypad(stdscr, TRUE);
+        noecho();
+        curs_set(0);
+        start_color();
+        init_pair(1, COLOR_CYAN, COLOR_BLACK);
+        init_pair(2, COLOR_BLACK, COLOR_MAGENTA);
+        init_pair(3, COLOR_MAGENTA, COLOR_BLACK);
+
+        bool running = true;
+        while (running) {
+            clampToFile();
+            draw();
+            // Keep the line count in the status bar moving while the index is built.
+            timeout(index.complete() ? -1 : 250);
+            int ch = getch();
+            timeout(-1);
+            clampToFile(); // The file may have shrunk while we waited for the key.
+            switch (ch) {
+                case KEY_UP: case 'k':
+                    top = lineBefore(top);
+                    break;
+                case KEY_DOWN: case 'j': case '\n':
+                    if (lineAfter(top) < size) top = lineAfter(top);
+                    break;
+                case KEY_PPAGE: case 'b':
+                    for (int i = 0; i < LINES - 1; i++) top = lineBefore(top);
+                    break;
+                case KEY_NPAGE: case ' ':
+                    for (int i = 0; i < LINES - 1 && lineAfter(top) < size; i++) top = lineAfter(top);
+                    break;
+                case KEY_HOME: case 'g':
+                    top = 0;
+                    left = 0;
+                    break;
+                case KEY_END: case 'G':
+                    top = size;
+                    for (int i = 0; i < LINES - 1; i++) top = lineBefore(top);
+                    break;
+                case KEY_LEFT: case 'h':
+                    left = std::max(0, left - 8);
+                    break;
+                case KEY_RIGHT: case 'l':
+                    left += 8;
+                    break;
+                case ':': case 'L': case 12: // Ctrl+L, like the editor
+                    goTo();
+                    break;
+                case 'q': case 24: // q or Ctrl+X
+                    running = false;
+                    break;
+                case KEY_RESIZE:
+                    // Dragging a border sends a burst of these, only draw for the last.
+                    timeout(40);
+                    while ((ch = getch()) == KEY_RESIZE) {}
+                    timeout(-1);
+                    if (ch != ERR) ungetch(ch);
+                    break;
+            }
+            // A jump the index couldn't place yet is fixed up once the index gets there.
+            if (pendingLine && top != estimatedTop) {
+                pendingLine = 0; // Moved away since, leave it.
+            } else if (pendingLine) {
+                uint64_t line, mark;
+                if (index.markForLine(pendingLine - 1, line, mark)) {
+                    jumpToLine(pendingLine);
+                }
+            }
+        }
+        endwin();
+        return 0;
+    }
+
+private:
+    // A log can be cut short under us (logrotate's copytruncate). Reading the
+    // mapping past the new end would kill us with SIGBUS, so the end we read up
+    // to is pulled in first. Growth isn't picked up, the mapping stays as it was.
+    void clampToFile() {
+        struct stat info;
+        if (fd < 0 || fstat(fd, &info) != 0 || (uint64_t)info.st_size >= size) {
+            return;
+        }
+        size = info.st_size;
+        rowStarts.clear();
+        top = lineStartAt(std::min(top, size ? size - 1 : 0));
+    }
+
+    // Asks on the status line, returns what was typed ("" if cancelled).
+    std::string ask(const std::string &question) {
+        std::string answer;
+        while (true) {
+            attron(COLOR_PAIR(2));
+            mvprintw(LINES - 1, 0, "%s%s", question.c_str(), answer.c_str());
+            clrtoeol();
+            attroff(COLOR_PAIR(2));
+            refresh();
+            int ch = getch();
+            if (ch == '\n' || ch == KEY_ENTER) return answer;
+            if (ch == 27 || ch == 24) return "";
+            if ((ch == KEY_BACKSPACE || ch == 127 || ch == 8) && !answer.empty()) {
+                answer.pop_back();
+            } else if (ch >= 32 && ch < 127 && answer.size() < 32) {
+                answer += (char)ch;
+            }
+        }
+    }
+
+    void goTo() {
+        JumpKind kind;
+        uint64_t value;
+        std::string input = ask("Go to line number (or 50%, or b1234 for a byte): ");
+        if (input.empty() || !parseJump(input, kind, value)) {
+            return;
+        }
+        pendingLine = 0;
+        if (kind == JUMP_LINE) {
+            jumpToLine(std::max<uint64_t>(value, 1));
+        } else if (kind == JUMP_PERCENT) {
+            top = lineStartAt(size * value / 100);
+            left = 0;
+        } else {
+            uint64_t offset = std::min(value, size ? size - 1 : 0);
+            top = lineStartAt(offset);
+            left = std::max<int64_t>(0, (int64_t)(offset - top) - (COLS - 2));
+        }
+    }
+
+    // Goes to line number (from 1). Exact when the index has got that far,
+    // otherwise a guess from how long lines are so far, put right later.
+    void jumpToLine(uint64_t number) {
+        uint64_t line, mark;
+        left = 0;
+        if (index.markForLine(number - 1, line, mark)) {
+            top = mark;
+            for (; line < number - 1 && lineAfter(top) < size; line++) {
+                top = lineAfter(top);
+            }
+            pendingLine = 0;
+            return;
+        }
+        if (index.complete()) {
+            top = lineStartAt(size ? size - 1 : 0); // Past the end, the last line.
+            pendingLine = 0;
+            return;
+        }
+        index.lastMark(line, mark);
+        double guess = mark + (number - 1 - line) * bytesPerLine();
+        top = lineStartAt(std::min<double>(guess, size ? size - 1 : 0));
+        pendingLine = number;
+        estimatedTop = top;
+    }
+
+    // Average line length: from the index once it has something, before that
+    // from 16 pieces of the file. The pieces are read with pread so they don't
+    // stay in our memory.
+    double bytesPerLine() {
+        uint64_t line, mark;
+        index.lastMark(line, mark);
+        if (line >= LineIndex::linesPerMark * 16) {
+            return (double)mark / line;
+        }
+        if (sampledBytesPerLine == 0) {
+            int fd = open(name.c_str(), O_RDONLY | O_CLOEXEC);
+            std::vector<char> piece(1 << 16);
+            uint64_t bytes = 0, lines = 0;
+            for (int i = 0; fd >= 0 && i < 16; i++) {
+                ssize_t got = pread(fd, piece.data(), piece.size(), size / 16 * i);
+                if (got <= 0) continue;
+                bytes += got;
+                lines += std::count(piece.begin(), piece.begin() + got, '\n');
+            }
+            if (fd >= 0) close(fd);
+            sampledBytesPerLine = lines ? (double)bytes / lines : std::max<double>(size, 1);
+        }
+        return sampledBytesPerLine;
+    }
+
+    // Where the line holding the byte at offset starts.
+    uint64_t lineStartAt(uint64_t offset) const {
+        return offset >= size ? lineBefore(size) : lineBefore(offset + 1);
+    }
+
+    // Where the line after the one starting at offset starts (size at the end).
+    uint64_t lineAfter(uint64_t offset) const {
+        if (offset >= size) return size;
+        const char *newline = static_cast<const char *>(memchr(data + offset, '\n', size - offset));
+        return newline ? newline - data + 1 : size;
+    }
+
+    // Where the line before the one starting at offset starts.
+    uint64_t lineBefore(uint64_t offset) const {
+        if (offset == 0) return 0;
+        const char *newline = static_cast<const char *>(memrchr(data, '\n', offset - 1));
+        return newline ? newline - data + 1 : 0;
+    }
+
+    // The line number (from 1) of the line starting at offset, if the index got there.
+    bool lineNumberAt(uint64_t offset, uint64_t &number) {
+        uint64_t line, mark;
+        if (!index.markBefore(offset, line, mark)) {
+            return false;
+        }
+        for (uint64_t at = mark; at < offset; at = lineAfter(at)) {
+            line++;
+        }
+        number = line + 1;
+        return true;
+    }
+
+    // Where each row on screen starts, plus where the one after the last starts.
+    // Kept between frames: a resize only looks for the rows it added, and
+    // scrolling down keeps the rows that are still on screen.
+    void layOutRows() {
+        auto kept = std::lower_bound(rowStarts.begin(), rowStarts.end(), top);
+        if (kept == rowStarts.end() || *kept != top) {
+            rowStarts.assign(1, top);
+        } else {
+            rowStarts.erase(rowStarts.begin(), kept);
+        }
+        while ((int)rowStarts.size() < LINES) {
+            rowStarts.push_back(lineAfter(rowStarts.back()));
+        }
+    }
+
+    void draw() {
+        layOutRows();
+        for (int row = 0; row < LINES - 1; row++) {
+            move(row, 0);
+            uint64_t offset = rowStarts[row];
+            if (offset < size) {
+                uint64_t next = rowStarts[row + 1];
+                uint64_t length = next - offset - (data[next - 1] == '\n' ? 1 : 0);
+                if ((uint64_t)left < length) {
+                    int shown = (int)std::min<uint64_t>(length - left, COLS - 1);
+                    attron(COLOR_PAIR(1));
+                    addnstr(data + offset + left, shown);
+                    attroff(COLOR_PAIR(1));
+                }
+                clrtoeol();
+                if (length > left + (uint64_t)COLS - 1) {
+                    attron(COLOR_PAIR(3));
+                    mvaddch(row, COLS - 1, '>');
+                    attroff(COLOR_PAIR(3));
+                }
+                continue;
+            } else {
+                attron(COLOR_PAIR(3));
+                addch('~');
+                attroff(COLOR_PAIR(3));
+            }
+            clrtoeol();
+        }
+
+        // The line number is worked out from the index, never by counting from the start.
+        std::string where;
+        uint64_t number;
+        if (lineNumberAt(top, number)) {
+            where = "Line: " + std::to_string(number);
+        } else {
+            // Not indexed that far yet, guess from how long the lines are.
+            uint64_t line, mark;
+            index.lastMark(line, mark);
+            where = "Line: ~" + std::to_string(line + 1 + (uint64_t)((top - mark) / bytesPerLine()));
+        }
+        if (index.complete()) {
+            where += " of " + std::to_string(index.lineCount()) + " | Word Count: " + std::to_string(index.wordCount());
+        } else {
+            where += " (indexing " + std::to_string(index.progress()) + "%)";
+        }
+        int percent = size ? (int)(lineAfter(top) * 100 / size) : 100;
+        move(LINES - 1, 0);
+        attron(COLOR_PAIR(2));
+        mvprintw(LINES - 1, 0, "NemoS 4.0 | View: %s [Read only] | File Size: %s | %s | %d%% | q: Quit",
+                 name.c_str(), getFileSize(name).c_str(), where.c_str(), percent);
+        clrtoeol();
+        attroff(COLOR_PAIR(2));
+        refresh();
+    }
+
+    const char *data = nullptr;
+    int fd = -1;
+    uint64_t size = 0; // How much of the mapping may be read.
+    uint64_t mappedSize = 0;
+    uint64_t top = 0; // Where the first line on screen starts.
+    std::vector<uint64_t> rowStarts; // See layOutRows.
+    uint64_t pendingLine = 0; // A line jumped to by guessing, to be put right.
+    uint64_t estimatedTop = 0; // Where that guess put us.
+    double sampledBytesPerLine = 0;
+    int left = 0; // Columns scrolled off to the left.
+    std::string name;
+    LineIndex index;
+};
+
+// What a finished Task hands back to whoever co_awaits it.
+template <typename T>
+struct TaskResult {
+    T value{};
+
+    void return_value(T result) {
+        value = std::move(result);
+    }
+
+    T take() {
+        return std::move(value);
+    }
+};
+
+template <>
+struct TaskResult<void> {
+    void return_void() {}
+    void take() {}
+};
+
+// A prompt or anything else that waits for keys, written as plain top to bottom
+// code. It starts running straight away and goes until it has to wait for a key,
+// then the editor loop carries on with everything else and resumes it when the
+// key comes. co_await on another Task waits for that one and gets its result.
+template <typename T = void>
+class Task {
+public:
+    struct promise_type : TaskResult<T> {
+        std::coroutine_handle<> waiting; // The Task that co_awaits this one.
+
+        Task get_return_object() {
+            return Task(std::coroutine_handle<promise_type>::from_promise(*this));
+        }
+
+        std::suspend_never initial_suspend() noexcept {
+            return {};
+        }
+
+        // Goes straight on with the Task that was waiting, if any.
+        struct Finished {
+            bool await_ready() noexcept {
+                return false;
+            }
+
+            std::coroutine_handle<> await_suspend(std::coroutine_handle<promise_type> done) noexcept {
+                std::coroutine_handle<> next = done.promise().waiting;
+                return next ? next : std::noop_coroutine();
+            }
+
+            void await_resume() noexcept {}
+        };
+
+        Finished final_suspend() noexcept {
+            return {};
+        }
+
+        void unhandled_exception() {
+            std::terminate();
+        }
+    };
+
+    Task() = default;
+
+    explicit Task(std::coroutine_handle<promise_type> handle) : handle(handle) {}
+
+    Task(Task &&other) noexcept : handle(std::exchange(other.handle, nullptr)) {}
+
+    Task &operator=(Task &&other) noexcept {
+        if (this != &other) {
+            reset();
+            handle = std::exchange(other.handle, nullptr);
+        }
+        return *this;
+    }
+
+    Task(const Task &) = delete;
+    Task &operator=(const Task &) = delete;
+
+    ~Task() {
+        reset();
+    }
+
+    bool done() const {
+        return !handle || handle.done();
+    }
+
+    bool await_ready() const noexcept {
+        return handle.done();
+    }
+
+    void await_suspend(std::coroutine_handle<> caller) noexcept {
+        handle.promise().waiting = caller;
+    }
+
+    T await_resume() {
+        return handle.promise().take();
+    }
+
+private:
+    void reset() {
+        if (handle) {
+            handle.destroy(); // One still waiting for a key just goes away.
+        }
+        handle = nullptr;
+    }
+
+    std::coroutine_handle<promise_type> handle;
+};
+
+class NemoS {
+public:
+    NemoS() {
+        // Resizes, hangups and kill are read from the event loop. Blocked before
+        // any thread starts, so all of them inherit it.
+        sigset_t handled;
+        sigemptyset(&handled);
+        sigaddset(&handled, SIGWINCH);
+        sigaddset(&handled, SIGHUP);
+        sigaddset(&handled, SIGTERM);
+        sigaddset(&handled, SIGQUIT);
+        pthread_sigmask(SIG_BLOCK, &handled, nullptr);
+        initscr();             // Start ncurses
+        raw();                 // Disable line buffering
+        keypad(stdscr, TRUE);  // Enable special keys
+        noecho();              // Don't echo input
+        start_color();         // Enable colors
+        // Define pinkish color pairs
+        init_pair(1, COLOR_CYAN, COLOR_BLACK);   // Text in pink
+        init_pair(2, COLOR_BLACK, COLOR_MAGENTA); // Status bar
+        init_pair(3, COLOR_MAGENTA, COLOR_BLACK); // Help text
+        init_pair(4, COLOR_BLACK, COLOR_WHITE); //Highlighter...
+        init_pair(5, COLOR_WHITE, COLOR_RED);   // Error messages
+        ctrlHomeKey = keyCodeFor("kHOM5");
+        ctrlEndKey = keyCodeFor("kEND5");
+        keyInput.start(STDIN_FILENO);
+        events.start(keyInput.descriptor(), handled);
+        streamReader.wakeOnData(events.jobsDescriptor());
+        clipboardReader.wakeOnData(events.jobsDescriptor());
+        status.wakeOnPost(events.jobsDescriptor());
+        if (const char *path = getenv("NEMOS_KEY_LATENCY")) {
+            latencyLog = fopen(path, "a");
+        }
+    }
+
+    ~NemoS() {
+        // Jobs on the pool hold snapshots and post back to us, they go first.
+        wordCountCancel->store(true);
+        searchCancel->store(true);
+        lineCacheCancel->store(true);
+        waitForJobs();
+        waitForSave(); // Never leave while a save is still writing the file.
+        signalJournal = nullptr;
+        journal.close(true); // Leaving normally, the swap file isn't needed anymore.
+        keyInput.stop();
+        if (latencyLog) {
+            fclose(latencyLog);
+        }
+        endwin(); // End ncurses
+    }
+
+void setFollow(bool follow) {
+    followMode = follow;
+}
+
+// cmd | nemos -: the buffer is filled from fd as it arrives instead of from a file.
+void setInput(int fd) {
+    inputFd = fd;
+}
+
+void run(std::string &filename) {
+    if (filename.empty()) {
+        filename = "untitled.txt";
+    } else if (!isSafePath(filename)) {
+        drawMessage("Error: Invalid file path! :(");
+        filename = "untitled.txt";
+    }
+
+    if (inputFd >= 0) {
+        // Piped in, there is no file yet. Pick a name that won't overwrite one.
+        filename = "stdin.txt";
+        for (int n = 2; checkPermission(filename, EXISTS); n++) {
+            filename = "stdin-" + std::to_string(n) + ".txt";
+        }
+        content.assign(1, "");
+        lineOffsetsStaleFrom = 0;
+        snapshotStaleFrom = 0;
+        resetDiskLayout(filename);
+        streamBytes = 0;
+        streamReader.start(inputFd);
+    } else {
+        // Load the file (permission checks happen inside loadFile)
+        loadFile(filename);
+        startModal(startJournal(filename)); // May ask about a swap file once the editor is up.
+        watcher.watch(filename);
+    }
+
+    // Keep the swap file up to date if the terminal hangs up or we get killed,
+    // the signals arrive through the event loop.
+    signalJournal = &journal;
+    signal(SIGPIPE, SIG_IGN); // A clipboard program that quits early must not take us with it.
+    
+    // Only warn about write permissions if file exists
+    if (checkPermission(filename, EXISTS) && !isFileWriteable(filename)) {
+        drawMessage("Error: No write permission - opening read-only! :(");
+    }
+
+    if (followMode) {
+        cursorY = content.size() - 1; // Start at the end, like tail -f.
+        viewY = std::max(0, cursorY - (LINES - 2));
+    }
+
+    drawEditor(filename);
+}
+
+private:
+    int viewX = 0, viewY = 0; // Tracks the visible area (scroll position)
+
+    std::vector<std::string> content; // Stores the text file content
+    int cursorX = 0, cursorY = 0;     // Cursor position
+    std::stack<std::vector<std::string>> undoStack; // Undo stack
+    std::stack<std::vector<std::string>> redoStack; // Redo stack
+    std::deque<int> konamiSequence; //The easter egg. 
+    bool isModified = false; // Will  be used when the user tries to leave but may forget to save..
+    unsigned long editVersion = 0; // Goes up on every change, so a finished save knows if it is still current.
+
+    // Saving happens on a writer thread with its own copy of the lines.
+    std::thread saveThread;
+    std::atomic<bool> saveFinished{false};
+    bool saveSucceeded = false;
+    bool saveRunning = false;
+    bool saveAgain = false; // Ctrl+S was pressed again while a save was running.
+    unsigned long savingVersion = 0;
+    std::string savingFilename;
+
+    // What the file on disk looked like after the last load or save, so a save can
+    // patch just the lines that changed instead of writing the whole file again.
+    std::vector<uint64_t> diskOffsets; // Where each line starts on disk, plus the file size at the end.
+    bool diskLayoutKnown = false;
+    struct stat diskInfo; // Used to notice when someone else changed the file.
+    KeyInput keyInput;
+    EventLoop events;
+    // Dragging a pane border sends a burst of SIGWINCH, only the size it settles
+    // on is acted on: once none came for a bit, or the burst has gone on too long.
+    bool resizePending = false;
+    std::chrono::steady_clock::time_point resizeDue, resizeLatest;
+    bool diskEventSeen = false; // The watcher saw our file change, looked at once no save is running.
+    bool clockShown = false; // Ctrl+T, until the next key.
+    bool running = true; // Until the editor is left with Ctrl+X.
+    Task<> modal; // The prompt that gets the keys, see startModal.
+    std::coroutine_handle<> keyWaiter; // Waiting in nextKey.
+    int keyForWaiter = ERR;
+    bool helpShown = false;
+    // What the open prompt adds to the frame, drawFrame draws it with the rest.
+    struct {
+        std::string prompt; // On the message line instead of the messages.
+        std::string answer; // Typed so far, after the prompt.
+        bool typing = false; // The cursor waits after the answer instead of in the text.
+        std::string bar; // Instead of the status bar.
+        int matchY = -1, matchX = 0, matchLength = 0; // Shown reversed.
+        bool selecting = false; // Copy mode, from the anchor to the cursor.
+        int anchorY = 0, anchorX = 0;
+    } overlay;
+    StatusMessages status;
+    std::mutex completionMutex;
+    std::vector<std::function<void()>> completions; // From postToEditor.
+    // Jobs on the pool that use the editor, see submitJob.
+    std::mutex jobsMutex;
+    std::condition_variable jobsDone;
+    int jobsRunning = 0;
+    uint64_t streamBytes = 0; // Read from stdin or unpacked so far.
+    std::vector<int> keysBack; // Put back with unreadKey.
+    FILE *latencyLog = nullptr;
+    std::vector<KeyInput::Key> keysSinceFrame;
+    KillRing killRing;
+    StreamReader clipboardReader; // A paste from the desktop clipboard on its way.
+    pid_t clipboardPid = -1;
+    std::string clipboardText;
+    std::chrono::steady_clock::time_point clipboardDeadline;
+    struct {
+        int y = 0, x = 0, endY = 0, endX = 0; // Where the last paste went.
+        unsigned long version = 0; // editVersion right after it, Alt+Y only works until the next edit.
+        size_t ringIndex = 0;
+    } lastPaste;
+    int goalColumn = -1; // The column up and down try to keep, -1 when not moving up or down.
+    int ctrlHomeKey = -1, ctrlEndKey = -1;
+    std::set<int> dirtyLines; // Lines edited in place since the last save.
+    LineOffsets lineOffsets; // Byte offset <-> line, see byteOffsetOf and positionOfByte.
+    int lineOffsetsStaleFrom = 0; // Lines from here on need lineOffsets rebuilt, INT_MAX when it's up to date.
+    int structureChangedFrom = INT_MAX; // Lines were added or removed from here on.
+    struct stat savedInfo; // Filled in by the writer thread.
+    EditJournal journal; // The swap file.
+    AutosaveScheduler autosave;
+    FileWatcher watcher;
+    bool followMode = false; // --follow
+    int inputFd = -1; // Where piped input comes from.
+    StreamReader streamReader;
+    bool streamLineOpen = true; // The last line read from the pipe has no newline yet.
+    Compression fileCompression = COMPRESSION_NONE; // How the file is packed on disk.
+    bool partlyRead = false; // The compressed file was broken, the buffer only has the start of it.
+    struct stat partlyReadInfo; // That file, which must never be saved over.
+    uint64_t cachedWordCount = 0;
+    uint64_t wordCountVersion = UINT64_MAX; // The editVersion cachedWordCount was counted at.
+    uint64_t wordCountFor = UINT64_MAX; // The editVersion being counted on the pool, UINT64_MAX when none.
+    ThreadPool::CancelToken wordCountCancel = ThreadPool::newToken(); // Stops that count.
+    ThreadPool::CancelToken searchCancel = ThreadPool::newToken(); // Stops the search Find or Replace waits for.
+    ThreadPool::CancelToken lineCacheCancel = ThreadPool::newToken(); // Stops building the line cache.
+    SnapshotStore snapshots; // The text for readers on other threads, see publishSnapshot.
+    std::set<int> snapshotDirty; // Lines changed in place since the last snapshot.
+    int snapshotStaleFrom = 0; // Lines from here on may have moved since the last snapshot, INT_MAX when none did.
+    bool changedOnDisk = false; // Another program changed the file since we loaded or saved it.
+    std::string diskHead, diskTail; // The first and last bytes of the file as we know it.
+    static const size_t diskSampleSize = 4096;
+
+    void markModified() {
+        isModified = true;
+        editVersion++;
+        autosave.noteEdit();
+    }
+
+    // Every change to the text goes through the functions below, so they can keep
+    // track of what has to be written on the next save.
+    void touchLine(int y) {
+        if (y < structureChangedFrom) {
+            dirtyLines.insert(y);
+        }
+        if (y < snapshotStaleFrom) {
+            snapshotDirty.insert(y);
+        }
+        if (y < lineOffsetsStaleFrom) {
+            lineOffsets.setLength(y, content[y].size() + 1);
+        }
+        markModified();
+    }
+
+    void touchFrom(int y) {
+        structureChangedFrom = std::min(structureChangedFrom, y);
+        dirtyLines.erase(dirtyLines.lower_bound(y), dirtyLines.end());
+        lineOffsetsStaleFrom = std::min(lineOffsetsStaleFrom, y); // Lines moved, rebuilt when next asked.
+        snapshotStaleFrom = std::min(snapshotStaleFrom, y);
+        snapshotDirty.erase(snapshotDirty.lower_bound(y), snapshotDirty.end());
+        markModified();
+    }
+
+    // Brings the snapshot other threads read up to date with the text. Only the
+    // blocks with changed lines are copied, so after typing this is quick.
+    void publishSnapshot() {
+        if (snapshotDirty.empty() && snapshotStaleFrom == INT_MAX) {
+            return;
+        }
+        snapshots.publish(TextSnapshot::update(snapshots.latest(), content, snapshotDirty, snapshotStaleFrom));
+        snapshotDirty.clear();
+        snapshotStaleFrom = INT_MAX;
+    }
+
+    void ensureLineOffsets() {
+        if (lineOffsetsStaleFrom != INT_MAX) {
+            lineOffsets.build(content);
+            lineOffsetsStaleFrom = INT_MAX;
+        }
+    }
+
+    // Where line y, column x is in the text as it would be saved.
+    uint64_t byteOffsetOf(int y, int x) {
+        ensureLineOffsets();
+        return lineOffsets.offsetOf(y) + x;
+    }
+
+    // The line and column of a byte offset, clamped to the text.
+    void positionOfByte(uint64_t offset, int &y, int &x) {
+        ensureLineOffsets();
+        y = lineOffsets.lineAt(offset);
+        x = std::min<uint64_t>(offset - std::min(offset, lineOffsets.offsetOf(y)), content[y].size());
+    }
+
+    void insertText(int y, int x, const std::string &text) {
+        content[y].insert(x, text);
+        journal.append(EDIT_INSERT, y, x, 0, text);
+        touchLine(y);
+    }
+
+    void eraseText(int y, int x, int count) {
+        content[y].erase(x, count);
+        journal.append(EDIT_ERASE, y, x, count, "");
+        touchLine(y);
+    }
+
+    void replaceText(int y, int x, int count, const std::string &text) {
+        content[y].replace(x, count, text);
+        journal.append(EDIT_REPLACE, y, x, count, text);
+        touchLine(y);
+    }
+
+    // Enter: everything after x moves to a new line below.
+    void splitLine(int y, int x) {
+        content.insert(content.begin() + y + 1, content[y].substr(x));
+        content[y].erase(x);
+        journal.append(EDIT_SPLIT, y, x, 0, "");
+        touchFrom(y);
+    }
+
+    // Backspace at the start of a line: line y + 1 is added to the end of line y.
+    void joinLines(int y) {
+        content[y] += content[y + 1];
+        content.erase(content.begin() + y + 1);
+        journal.append(EDIT_JOIN, y, 0, 0, "");
+        touchFrom(y);
+    }
+
+    // Puts several lines in at (y, x), the rest of line y ends up after the last one.
+    // Splices all the lines in with one insert, so a big paste moves the lines
+    // below it once instead of once per pasted line. The lines are moved from.
+    void insertLines(int y, int x, std::vector<std::string> &&lines) {
+        if (lines.size() == 1) {
+            insertText(y, x, lines[0]);
+            return;
+        }
+        journal.append(EDIT_LINES, y, x, 0, joinWithNewlines(lines));
+        size_t count = lines.size();
+        std::string afterCursor = content[y].substr(x);
+        content[y].erase(x);
+        content[y] += lines[0];
+        content.insert(content.begin() + y + 1, std::make_move_iterator(lines.begin() + 1),
+                       std::make_move_iterator(lines.end()));
+        content[y + count - 1] += afterCursor;
+        touchFrom(y);
+    }
+
+    // Removes the text from (y, x) up to (endY, endX), across lines.
+    void eraseRange(int y, int x, int endY, int endX) {
+        if (endY == y) {
+            eraseText(y, x, endX - x);
+            return;
+        }
+        content[y].replace(x, std::string::npos, content[endY], endX, std::string::npos);
+        content.erase(content.begin() + y + 1, content.begin() + endY + 1);
+        journal.append(EDIT_ERASE_RANGE, y, x, endY - y, std::to_string(endX));
+        touchFrom(y);
+    }
+
+    void setContent(const std::vector<std::string> &lines) {
+        content = lines;
+        journal.append(EDIT_SET, 0, 0, 0, joinWithNewlines(content));
+        touchFrom(0);
+    }
+
+    static std::string joinWithNewlines(const std::vector<std::string> &lines) {
+        size_t size = lines.size();
+        for (const auto &line : lines) {
+            size += line.size();
+        }
+        std::string text;
+        text.reserve(size);
+        for (size_t i = 0; i < lines.size(); i++) {
+            if (i > 0) text += '\n';
+            text += lines[i];
+        }
+        return text;
+    }
+
+    static std::vector<std::string> splitAtNewlines(const std::string &text) {
+        std::vector<std::string> lines;
+        lines.reserve(std::count(text.begin(), text.end(), '\n') + 1);
+        const char *p = text.data(), *end = p + text.size();
+        const char *newline;
+        while ((newline = static_cast<const char *>(memchr(p, '\n', end - p))) != nullptr) {
+            lines.emplace_back(p, newline);
+            p = newline + 1;
+        }
+        lines.emplace_back(p, end);
+        return lines;
+    }
+
+    // Applies an edit read back from a swap file, checking it fits the text first.
+    bool applyEdit(const EditRecord &edit) {
+        if (edit.y < 0 || edit.y >= (int)content.size() || edit.x < 0 || edit.count < 0) {
+            return false;
+        }
+        int length = content[edit.y].size();
+        switch (edit.type) {
+            case EDIT_INSERT:
+                if (edit.x > length) return false;
+                insertText(edit.y, edit.x, edit.text);
+                break;
+            case EDIT_ERASE:
+                if (edit.x + edit.count > length) return false;
+                eraseText(edit.y, edit.x, edit.count);
+                break;
+            case EDIT_REPLACE:
+                if (edit.x + edit.count > length) return false;
+                replaceText(edit.y, edit.x, edit.count, edit.text);
+                break;
+            case EDIT_SPLIT:
+                if (edit.x > length) return false;
+                splitLine(edit.y, edit.x);
+                break;
+            case EDIT_JOIN:
+                if (edit.y + 1 >= (int)content.size()) return false;
+                joinLines(edit.y);
+                break;
+            case EDIT_LINES:
+                if (edit.x > length) return false;
+                insertLines(edit.y, edit.x, splitAtNewlines(edit.text));
+                break;
+            case EDIT_SET:
+                setContent(splitAtNewlines(edit.text));
+                break;
+            case EDIT_ERASE_RANGE: {
+                int endY = edit.y + edit.count;
+                int endX = atoi(edit.text.c_str());
+                if (endY >= (int)content.size() || edit.x > length || endX > (int)content[endY].size() ||
+                    (endY == edit.y && endX < edit.x)) return false;
+                eraseRange(edit.y, edit.x, endY, endX);
+                break;
+            }
+            default:
+                return false;
+        }
+        cursorY = std::min(edit.y, (int)content.size() - 1);
+        cursorX = std::min(edit.x, (int)content[cursorY].size());
+        return true;
+    }
+
+    Task<bool> askYesNo(std::string question) {
+        overlay.prompt = std::move(question);
+        overlay.typing = true;
+        int answer = co_await nextKey();
+        overlay.prompt.clear();
+        overlay.typing = false;
+        co_return answer == 'Y' || answer == 'y';
+    }
+
+    // Opens the swap file for the document. A swap file left behind by a run that
+    // never saved is offered back to the user before it is started again.
+    Task<> startJournal(std::string filename) {
+        journal.close(false);
+        if (streamReader.running()) {
+            co_return; // Still unpacking, readStream starts it when the whole text is in.
+        }
+        std::string swapPath = swapPathFor(filename);
+        bool existed = checkPermission(swapPath, EXISTS);
+        if (!journal.open(swapPath)) {
+            if (existed) {
+                drawMessage("Warning: This file is open in another NemoS - no swap file for this one! :(");
+            }
+            co_return;
+        }
+
+        struct stat base;
+        bool baseExists = stat(resolveSymlinks(filename).c_str(), &base) == 0;
+        std::vector<EditRecord> edits;
+        bool matchesFile = false;
+        if (existed && EditJournal::read(swapPath, baseExists ? &base : nullptr, edits, matchesFile) && !edits.empty()) {
+            if (!matchesFile) {
+                if (!co_await askYesNo("Warning: A swap file was found but the file has changed since. Delete the swap file? (Y/N)")) {
+                    journal.close(false); // Leave it alone and run without one.
+                    co_return;
+                }
+                edits.clear();
+            } else if (!co_await askYesNo("Unsaved changes from an earlier session were found (" + std::to_string(edits.size()) +
+                                          " edits). Recover them? (Y/N)")) {
+                edits.clear();
+            }
+        }
+
+        journal.start(baseExists ? &base : nullptr);
+        size_t applied = 0;
+        while (applied < edits.size() && applyEdit(edits[applied])) {
+            applied++;
+        }
+        if (applied > 0) {
+            viewY = std::max(0, cursorY - LINES / 3);
+            viewX = std::max(0, cursorX - COLS / 3);
+            drawMessage("Recovered " + std::to_string(applied) + " edit(s) from the swap file. :)");
+        }
+    }
+
+    // Remembers the file on disk as matching the buffer, after a load or a save.
+    void resetDiskLayout(const std::string &filename) {
+        dirtyLines.clear();
+        structureChangedFrom = INT_MAX;
+        diskOffsets.resize(content.size() + 1);
+        uint64_t offset = 0;
+        for (size_t i = 0; i < content.size(); i++) {
+            diskOffsets[i] = offset;
+            offset += content[i].size() + 1;
+        }
+        diskOffsets[content.size()] = offset;
+        // A file without a newline at the end doesn't match what we write.
+        if (stat(resolveSymlinks(filename).c_str(), &diskInfo) != 0) {
+            diskInfo = {}; // Not on the disk (yet).
+        }
+        diskLayoutKnown = diskInfo.st_ino != 0 && (uint64_t)diskInfo.st_size == offset;
+        rememberDiskSamples(filename);
+    }
+
+    void rememberDiskSamples(const std::string &filename) {
+        std::string target = resolveSymlinks(filename);
+        uint64_t size = diskInfo.st_size;
+        diskHead = readFileSample(target, 0, diskSampleSize);
+        uint64_t tailStart = size > diskSampleSize ? size - diskSampleSize : 0;
+        diskTail = readFileSample(target, tailStart, size - tailStart);
+        changedOnDisk = false;
+    }
+
+    // Picks up a change another program made to the file. Returns true if the
+    // screen needs drawing again.
+    bool checkExternalChange(const std::string &filename) {
+        // Our own save shows up here too, look at it once the save is done. The
+        // events are read right away all the same, epoll would keep waking us.
+        diskEventSeen |= watcher.changed();
+        if (saveRunning || !diskEventSeen || (followMode && !modal.done())) {
+            return false; // --follow changes the text, that waits for the prompt too.
+        }
+        if (streamReader.running() && inputFd < 0) {
+            return false; // Still reading it, finishLoading looks at the disk again.
+        }
+        diskEventSeen = false;
+        std::string target = resolveSymlinks(filename);
+        bool wasChanged = changedOnDisk;
+        if (access(target.c_str(), F_OK) != 0) {
+            changedOnDisk = diskInfo.st_ino != 0; // Deleted, unless it never existed.
+        } else {
+            changedOnDisk = !diskUnchangedSinceSave(target);
+        }
+        if (changedOnDisk && followMode && followFile(filename)) {
+            return true;
+        }
+        return changedOnDisk != wasChanged;
+    }
+
+    // True when the file on disk is the one we know with bytes added to the end.
+    bool onlyAppendedOnDisk(const std::string &target, const struct stat &now) {
+        if (fileCompression != COMPRESSION_NONE) {
+            return false; // New bytes at the end of a compressed file aren't new lines.
+        }
+        if (now.st_dev != diskInfo.st_dev || now.st_ino != diskInfo.st_ino || now.st_size < diskInfo.st_size) {
+            return false;
+        }
+        uint64_t oldSize = diskInfo.st_size;
+        return readFileSample(target, 0, diskHead.size()) == diskHead &&
+               readFileSample(target, oldSize - diskTail.size(), diskTail.size()) == diskTail;
+    }
+
+    // Adds bytes read from the end of the file to the end of the buffer. When the
+    // old last line had no newline yet, the first bytes finish that line.
+    void appendFromDisk(const char *data, size_t size, bool &lastLineOpen) {
+        size_t pos = 0;
+        snapshotStaleFrom = std::min<int>(snapshotStaleFrom, lastLineOpen ? std::max<int>(0, (int)content.size() - 1) : content.size());
+        while (pos < size) {
+            const char *newline = static_cast<const char *>(memchr(data + pos, '\n', size - pos));
+            size_t end = newline ? newline - data : size;
+            if (lastLineOpen) {
+                content.back().append(data + pos, end - pos);
+                if ((int)content.size() - 1 < lineOffsetsStaleFrom) {
+                    lineOffsets.setLength(content.size() - 1, content.back().size() + 1);
+                }
+            } else {
+                content.emplace_back(data + pos, end - pos);
+                if (lineOffsetsStaleFrom == INT_MAX) {
+                    lineOffsets.push(content.back().size() + 1);
+                }
+            }
+            lastLineOpen = (newline == nullptr);
+            pos = end + 1;
+        }
+    }
+
+    // appendFromDisk, keeping the word count up to date without counting the
+    // whole buffer again.
+    void appendCounted(const char *data, size_t size, bool &lastLineOpen) {
+        bool countsKnown = wordCountVersion == editVersion;
+        size_t firstChanged = lastLineOpen ? content.size() - 1 : content.size();
+        if (countsKnown && lastLineOpen) {
+            cachedWordCount -= countWords(content.back());
+        }
+        appendFromDisk(data, size, lastLineOpen);
+        if (countsKnown) {
+            for (size_t i = firstChanged; i < content.size(); i++) {
+                cachedWordCount += countWords(content[i]);
+            }
+        }
+    }
+
+    // Reads the bytes added to the end of the file since we last looked and puts
+    // them on the end of the buffer. Returns how many lines were added, -1 on error.
+    long readAppended(const std::string &filename) {
+        std::string target = resolveSymlinks(filename);
+        int fd = open(target.c_str(), O_RDONLY | O_CLOEXEC);
+        struct stat now;
+        if (fd < 0 || fstat(fd, &now) != 0) {
+            if (fd >= 0) close(fd);
+            return -1;
+        }
+        uint64_t offset = diskInfo.st_size;
+        bool lastLineOpen = offset == 0 || diskTail.back() != '\n';
+        size_t oldLines = content.size();
+        bool layoutWasKnown = diskLayoutKnown && !lastLineOpen && structureChangedFrom == INT_MAX;
+
+        // Only up to the size we just saw, anything written after that is the next event.
+        std::vector<char> buffer(1 << 20);
+        while (offset < (uint64_t)now.st_size) {
+            ssize_t got = pread(fd, buffer.data(), std::min<uint64_t>(buffer.size(), now.st_size - offset), offset);
+            if (got <= 0) break;
+            appendCounted(buffer.data(), got, lastLineOpen);
+            offset += got;
+        }
+        close(fd);
+
+        // The new lines match the disk, the lines before them haven't moved.
+        if (layoutWasKnown) {
+            for (size_t i = oldLines; i < content.size(); i++) {
+                diskOffsets.push_back(diskOffsets.back() + content[i].size() + 1);
+            }
+        }
+        diskInfo = now;
+        diskInfo.st_size = offset;
+        diskLayoutKnown = layoutWasKnown && !lastLineOpen && offset == diskOffsets.back();
+        rememberDiskSamples(filename);
+        // The swap file starts again from the new file. Unsaved edits were logged
+        // against the file before the new lines, so the whole text goes on top.
+        journal.rebase(diskInfo);
+        if (isModified) {
+            journal.append(EDIT_SET, 0, 0, 0, joinWithNewlines(content));
+        }
+        return content.size() - oldLines;
+    }
+
+    // --follow: keeps reading what gets added to the file, like tail -f. The view
+    // sticks to the end while the cursor is on the last line.
+    bool followFile(const std::string &filename) {
+        std::string target = resolveSymlinks(filename);
+        struct stat now;
+        if (isModified || stat(target.c_str(), &now) != 0) {
+            return false; // Leave it to the user (Ctrl+E).
+        }
+        bool atEnd = cursorY >= (int)content.size() - 1;
+        if (onlyAppendedOnDisk(target, now)) {
+            if (readAppended(filename) < 0) {
+                return false;
+            }
+        } else {
+            // Truncated or rotated, start over from the new file.
+            journal.close(true);
+            loadFile(filename);
+            startModal(startJournal(filename));
+            atEnd = true;
+        }
+        if (atEnd) {
+            cursorY = content.size() - 1;
+            cursorX = 0;
+            viewX = 0;
+            viewY = std::max(0, cursorY - (LINES - 2));
+        }
+        return true;
+    }
+
+    // Puts what arrived from the pipe or the unpacker at the end of the buffer.
+    // Returns true if the screen needs drawing again.
+    bool readStream(const std::string &filename) {
+        if (!streamReader.running()) {
+            return false;
+        }
+        std::string arrived;
+        bool open = streamReader.take(arrived, 4 << 20);
+        if (!arrived.empty()) {
+            bool atEnd = (inputFd >= 0 || followMode) && cursorY >= (int)content.size() - 1; // Piped output and --follow are followed.
+            appendCounted(arrived.data(), arrived.size(), streamLineOpen);
+            streamBytes += arrived.size();
+            if (atEnd) {
+                cursorY = content.size() - 1;
+                cursorX = 0;
+                viewY = std::max(0, cursorY - (LINES - 2));
+            }
+        }
+        if (!open) {
+            if (inputFd >= 0) {
+                inputFd = -1;
+                markModified(); // All in. None of it is saved anywhere yet.
+            } else if (streamReader.failed()) {
+                // Saving would put the part we read in place of the whole file.
+                partlyRead = true;
+                partlyReadInfo = diskInfo;
+                autosave.setPaused(true);
+                drawMessage(fileCompression != COMPRESSION_NONE ?
+                            "Error: The compressed file is broken, only part of it was read! Ctrl+S saves it under a new name. :(" :
+                            "Error: Could not read the whole file, only part of it was read! Ctrl+S saves it under a new name. :(");
+            } else {
+                if (fileCompression == COMPRESSION_NONE) {
+                    finishLoading(filename);
+                }
+                startModal(startJournal(filename)); // Recovery can only replay onto the whole text.
+            }
+            return true;
+        }
+        return !arrived.empty();
+    }
+
+    // A plain file is all in: its lines can be matched to the disk now, which in
+    // place saves and --follow need. Not if it was edited while it came in.
+    void finishLoading(const std::string &filename) {
+        resetDiskLayout(filename);
+        if (isModified) {
+            diskLayoutKnown = false;
+            return;
+        }
+        updateLineCache(filename);
+    }
+
+    // Big files: leaves a line cache for next time and for --view. Making one goes
+    // over every line, so it is done on the pool from a snapshot. The word count
+    // was already kept up as the lines came in.
+    void updateLineCache(const std::string &filename) {
+        if ((uint64_t)diskInfo.st_size < lineCacheMinSize) {
+            return;
+        }
+        lineCacheCancel->store(true);
+        lineCacheCancel = ThreadPool::newToken();
+        auto cancel = lineCacheCancel;
+        publishSnapshot();
+        auto reader = std::make_shared<SnapshotStore::Reader>(snapshots);
+        std::string target = resolveSymlinks(filename);
+        struct stat loaded = diskInfo;
+        submitJob([this, reader, target, loaded, cancel]() {
+            const TextSnapshot &text = reader->text();
+            int fd = open(target.c_str(), O_RDONLY | O_CLOEXEC);
+            struct stat now;
+            LineCache cache;
+            // Only for the file the text came from, and only if it has no cache yet.
+            if (fd >= 0 && fstat(fd, &now) == 0 && now.st_dev == loaded.st_dev && now.st_ino == loaded.st_ino &&
+                now.st_size == loaded.st_size && now.st_mtim.tv_sec == loaded.st_mtim.tv_sec &&
+                now.st_mtim.tv_nsec == loaded.st_mtim.tv_nsec &&
+                !(loadLineCache(fd, cache) && cache.totalLines == text.size())) {
+                cache = LineCache();
+                uint64_t offset = 0;
+                size_t i = 0;
+                for (const std::string &line : text) {
+                    if (i % lineCacheLinesPerMark == 0) {
+                        if (cancel->load()) {
+                            break;
+                        }
+                        cache.marks.push_back(offset);
+                        cache.blockWords.push_back(0);
+                    }
+                    cache.blockWords.back() += countWords(line);
+                    offset += line.size() + 1;
+                    i++;
+                }
+                cache.totalLines = i;
+                if (!cancel->load()) {
+                    saveLineCache(fd, cache);
+                }
+            }
+            if (fd >= 0) {
+                close(fd);
+            }
+            postToEditor([this]() {
+                snapshots.collect();
+            });
+        }, ThreadPool::BACKGROUND);
+    }
+
+    // Ctrl+E: brings the buffer up to date with the file on disk. When the file only
+    // grew, just the new end is read; anything else means loading it again.
+    Task<> reloadFile(std::string filename) {
+        std::string target = resolveSymlinks(filename);
+        struct stat now;
+        if (stat(target.c_str(), &now) != 0) {
+            drawMessage("Error: The file is not on the disk anymore! :(");
+            co_return;
+        }
+        waitForSave();
+        if (streamReader.running() && inputFd < 0) {
+            drawMessage("Error: The file is still being read, reload when it is done! :(");
+            co_return;
+        }
+
+        if (onlyAppendedOnDisk(target, now)) {
+            long added = readAppended(filename);
+            if (added < 0) {
+                drawMessage("Error: Could not read the file! :(");
+            } else {
+                drawMessage("Read " + std::to_string(added) + " new line(s) from the end of the file. :)");
+            }
+            co_return;
+        }
+
+        if (isModified && !co_await askYesNo("The file was changed by another program. Reload it and lose your changes? (Y/N)")) {
+            co_return;
+        }
+        journal.close(true);
+        loadFile(filename);
+        co_await startJournal(filename);
+        cursorY = std::min(cursorY, (int)content.size() - 1);
+        cursorX = std::min(cursorX, (int)content[cursorY].size());
+        viewY = std::min(viewY, cursorY);
+    }
+
+    bool diskUnchangedSinceSave(const std::string &target) {
+        struct stat now;
+        return stat(target.c_str(), &now) == 0 && now.st_ino == diskInfo.st_ino && now.st_dev == diskInfo.st_dev &&
+               now.st_size == diskInfo.st_size && now.st_mtim.tv_sec == diskInfo.st_mtim.tv_sec &&
+               now.st_mtim.tv_nsec == diskInfo.st_mtim.tv_nsec;
+    }
+
+    // Works out the pieces an in place save has to write. Lines that kept their
+    // length are patched where they are; from the first line that changed length
+    // (or where lines were added or removed) the rest of the file is rewritten.
+    // Returns false when writing the whole file is the better choice.
+    bool planPatchSave(const std::string &target, std::vector<SavePatch> &patches, size_t &tailLine, uint64_t &newSize) {
+        const uint64_t smallFile = 1 << 20; // A whole rewrite of a small file is cheap and simplest.
+        if (!diskLayoutKnown || diskOffsets.back() < smallFile || !diskUnchangedSinceSave(target)) {
+            return false;
+        }
+        size_t diskLines = diskOffsets.size() - 1;
+        tailLine = std::min<size_t>(structureChangedFrom, std::min(diskLines, content.size()));
+        uint64_t written = 0;
+        for (int y : dirtyLines) {
+            if ((size_t)y >= tailLine) break;
+            if (content[y].size() != diskOffsets[y + 1] - diskOffsets[y] - 1) {
+                tailLine = y;
+                break;
+            }
+            patches.push_back({diskOffsets[y], content[y]});
+            written += content[y].size();
+        }
+
+        newSize = diskOffsets[tailLine];
+        for (size_t i = tailLine; i < content.size(); i++) {
+            newSize += content[i].size() + 1;
+        }
+        written += newSize - diskOffsets[tailLine];
+        // The journal doubles what is written, past half the file a rewrite is as quick.
+        return written * 2 < newSize;
+    }
+void loadFile(const std::string &filename) {
+    // Clear existing content
+    content.clear();
+    lineOffsetsStaleFrom = 0;
+    snapshotStaleFrom = 0;
+    editVersion++;
+    autosave.noteSave();
+    autosave.setPaused(false);
+    streamReader.stop();
+    inputFd = -1;
+    partlyRead = false;
+    fileCompression = compressionForName(filename);
+    
+    // Check if file exists first
+    if (!checkPermission(filename, EXISTS)) {
+        // File doesn't exist - start with empty buffer
+        content.push_back("");
+        isModified = false;
+        diskLayoutKnown = false;
+        return;
+    }
+
+    // File exists - check read permission
+    if (!checkPermission(filename, READABLE)) {
+        drawMessage("Error: No read permission - opening read-only! :(");
+        content.push_back(""); // Start with empty buffer
+        isModified = false;
+        diskLayoutKnown = false;
+        return;
+    }
+
+    // Finish an in place save that a crash interrupted before reading the file.
+    int recovered = recoverPatchJournal(resolveSymlinks(filename));
+    if (recovered > 0) {
+        drawMessage("An interrupted save has been finished. :)");
+    } else if (recovered < 0) {
+        drawMessage("Error: Could not finish an interrupted save! :(");
+    }
+
+    // Compressed files are unpacked in the background, the first screen shows up
+    // as soon as the first piece is ready.
+    fileCompression = detectCompression(filename);
+    if (fileCompression != COMPRESSION_NONE) {
+        if (fileCompression == COMPRESSION_ZSTD && !ZstdLibrary::get()) {
+            drawMessage("Error: libzstd is not installed, can't open .zst files! :(");
+        }
+        content.push_back("");
+        streamLineOpen = true;
+        isModified = false;
+        resetDiskLayout(filename);
+        diskLayoutKnown = false; // Never patched in place.
+        autosave.configure(diskInfo.st_size);
+        Compression compression = fileCompression;
+        std::string target = resolveSymlinks(filename);
+        streamBytes = 0;
+        streamReader.start([target, compression](const StreamReader::Sink &sink) {
+            return decompressFile(target, compression, sink);
+        });
+        return;
+    }
+
+    // Try to open the file
+    int fd = open(resolveSymlinks(filename).c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        drawMessage("Error: Could not open the file! :(");
+        content.push_back("");
+        diskLayoutKnown = false;
+        return;
+    }
+    posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+    // Plain files come in on a thread too, so a big one never holds up the keys.
+    // readStream finishes up with finishLoading once all of it is in.
+    content.push_back("");
+    streamLineOpen = true;
     isModified = false;
+    resetDiskLayout(filename);
+    diskLayoutKnown = false; // Until the lines are all in.
+    autosave.configure(diskInfo.st_size);
+    cachedWordCount = 0;
+    wordCountVersion = editVersion; // appendCounted keeps it up to date as lines arrive.
+    streamBytes = 0;
+    streamReader.start(fd);
 }
 void saveFile(const std::string &filename) {
     // For new files, check directory permissions instead
@@ -299,18 +4571,165 @@ void saveFile(const std::string &filename) {
         return;
     }
 
-    std::ofstream file(filename);
-    if (!file.is_open()) {
-        drawMessage("Error: Could not save the file! :(");
+    if (streamReader.running() && inputFd < 0) {
+        drawMessage("Error: The file is still being read, save when it is done! :(");
         return;
     }
-    
-    for (const auto &line : content) {
-        file << line << "\n";
+
+    if (isPartlyRead(filename)) {
+        drawMessage("Error: Only part of this file was read, it can only be saved under a new name! :(");
+        return;
     }
-    isModified = false;
+
+    if (saveRunning) {
+        // Only one writer at a time, the newest text gets saved when it is done.
+        saveAgain = true;
+        savingFilename = filename;
+        return;
+    }
+
+    std::string target = resolveSymlinks(filename);
+    std::vector<SavePatch> patches;
+    size_t tailLine = 0;
+    uint64_t newSize = 0;
+    bool patching = planPatchSave(target, patches, tailLine, newSize);
+    // The writer thread reads a snapshot, so the text isn't copied here.
+    publishSnapshot();
+    auto snapshot = std::make_shared<SnapshotStore::Reader>(snapshots);
+
+    if (patching) {
+        // Only the changed lines and the rewritten end of the file are written.
+        diskOffsets.resize(tailLine + 1);
+        for (size_t i = tailLine; i < content.size(); i++) {
+            diskOffsets.push_back(diskOffsets.back() + content[i].size() + 1);
+        }
+        dirtyLines.clear();
+        structureChangedFrom = INT_MAX;
+    } else {
+        resetDiskLayout(filename);
+    }
+    // From here on edits are tracked against the text being saved.
+    diskLayoutKnown = fileCompression == COMPRESSION_NONE;
+    journal.checkpoint();
+    autosave.noteSave();
+
+    savingVersion = editVersion;
+    savingFilename = filename;
+    saveRunning = true;
+    saveFinished = false;
+    uint64_t tailOffset = diskOffsets[tailLine];
+    Compression compression = fileCompression;
+    int wakeFd = events.jobsDescriptor();
+    saveThread = std::thread([this, snapshot, patching, tailLine, target, tailOffset, newSize, compression, wakeFd, patches = std::move(patches)]() mutable {
+        const TextSnapshot &text = snapshot->text();
+        if (!patching) {
+            saveSucceeded = saveLines(target, text, compression);
+            if (saveSucceeded) {
+                dropPatchJournal(target); // Whatever it held is older than what was just written.
+            }
+        } else {
+            SavePatch rest{tailOffset, std::string()};
+            rest.data.reserve(newSize - tailOffset);
+            for (auto line = text.lineAt(tailLine); line != text.end(); ++line) {
+                rest.data += *line;
+                rest.data += '\n';
+            }
+            patches.push_back(std::move(rest));
+            saveSucceeded = savePatches(target, patches, newSize);
+        }
+        if (saveSucceeded) {
+            saveSucceeded = stat(target.c_str(), &savedInfo) == 0;
+        }
+        saveFinished.store(true, std::memory_order_release);
+        uint64_t one = 1;
+        write(wakeFd, &one, sizeof(one));
+    });
+}
+
+// Called from the editor loop to pick up a save that the writer thread finished.
+bool checkSave() {
+    if (!saveRunning || !saveFinished.load(std::memory_order_acquire)) {
+        return false;
+    }
+    if (saveThread.joinable()) {
+        saveThread.join();
+    }
+    saveRunning = false;
+    snapshots.collect(); // The version it wrote can go now.
+
+    if (!saveSucceeded) {
+        saveAgain = false;
+        diskLayoutKnown = false; // The next save writes the whole file.
+        journal.dropCheckpoint();
+        autosave.setPaused(true); // Don't keep failing in the background.
+        drawMessage(autosave.isEnabled() ? "Error: Could not save the file! Autosave has been turned off. :("
+                                         : "Error: Could not save the file! :(");
+        return true;
+    }
+    diskInfo = savedInfo;
+    rememberDiskSamples(savingFilename);
+    watcher.watch(savingFilename);
+    // Events from another program writing while we saved went with the old
+    // watcher, so compare what is on disk with what we saved once.
+    diskEventSeen = true;
+    journal.rebase(savedInfo);
+    autosave.configure(savedInfo.st_size);
+    autosave.setPaused(false);
+    // Anything typed after the copy was taken still needs saving.
+    if (editVersion == savingVersion) {
+        isModified = false;
+    }
+    if (saveAgain) {
+        saveAgain = false;
+        saveFile(savingFilename);
+    }
+    return true;
+}
+
+// Points the event loop's timers at whatever comes due next. There is no
+// polling: with nothing going on the editor sleeps until a key or a signal.
+void armTimers() {
+    bool prompting = !modal.done(); // Autosave and pastes wait for the prompt, no point waking for them.
+    events.setTimer(EventLoop::AUTOSAVE_TIMER, saveRunning || prompting ? -1 : autosave.msUntilDue()); // A finished save wakes us itself.
+    long long clipboardLeft = std::chrono::duration_cast<std::chrono::milliseconds>(
+        clipboardDeadline - std::chrono::steady_clock::now()).count();
+    events.setTimer(EventLoop::DEADLINE_TIMER, (clipboardReader.running() || clipboardPid > 0) && !prompting ? std::max(0LL, clipboardLeft) : -1);
+    long long msIntoSecond = std::chrono::duration_cast<std::chrono::milliseconds>(
+        std::chrono::system_clock::now().time_since_epoch()).count() % 1000;
+    events.setTimer(EventLoop::CLOCK_TIMER, clockShown ? 1000 - msIntoSecond : -1);
+    events.setTimer(EventLoop::STATUS_TIMER, status.msUntilExpiry());
+    events.setTimer(EventLoop::RESIZE_TIMER, resizePending ? msUntilResize() : -1);
+    events.watchDisk(watcher.descriptor());
+}
+
+// Saves in the background once the scheduler says so. Only files that are already
+// on disk are saved this way, a new file is created by the user pressing Ctrl+S.
+bool runAutosave(const std::string &filename) {
+    if (saveRunning || !autosave.due()) {
+        return false;
+    }
+    if (!isModified) {
+        autosave.noteSave(); // Undone back to the saved text, nothing to do.
+        return false;
+    }
+    if (streamReader.running()) {
+        return false; // Not the whole text yet.
+    }
+    // Never write over changes another program made.
+    if (changedOnDisk || !checkPermission(filename, EXISTS) || !isFileWriteable(filename)) {
+        autosave.setPaused(true);
+        return false;
+    }
+    saveFile(filename);
+    return true;
 }
 
+void waitForSave() {
+    while (saveRunning) {
+        saveThread.join();
+        checkSave(); // May start the save that was asked for while this one ran.
+    }
+}
 
     std::string getCurrentTime(){
         time_t now = time(0); //Getting the current time.
@@ -320,36 +4739,28 @@ void saveFile(const std::string &filename) {
         strftime(buf, sizeof(buf),"%H:%M:%S", &tstruct);
         return std::string(buf);
     }
-    void LiveTime(){
-        while (true){
-            std::string timeStr = getCurrentTime();
-            attron(COLOR_PAIR(2));
-            //mvprintw(LINES - 1, COLS - 10, "%s", timeStr.c_str());
-            attroff(COLOR_PAIR(2));
-            refresh();
-            napms(1000); // Wait 1 second before updating time        
-            }
-    }
-
-    void renameFile(std::string &filename) {
-        drawMessage("Enter new filename: ");
-        echo();
-        char newFilename[256];
-        getstr(newFilename);
-        noecho();
+    // filename is the editor loop's, it outlives every prompt.
+    Task<> renameFile(std::string &filename) {
+        std::optional<std::string> newFilename = co_await readLine("Enter new filename: ");
+        if (!newFilename) {
+            co_return;
+        }
 
-        if (!isSafePath(newFilename)) {
+        if (!isSafePath(*newFilename)) {
             drawMessage("Error: Invalid file path! :(");
-            return;
+            co_return;
         }
 
         if (!isFileWriteable(filename)) {
             drawMessage("Error: No permission to rename file! :(");
-            return;
+            co_return;
         }
 
-        if (std::rename(filename.c_str(), newFilename) == 0) {
-            filename = newFilename;
+        waitForSave(); // A running save would bring the old name back.
+        if (std::rename(filename.c_str(), newFilename->c_str()) == 0) {
+            filename = *newFilename;
+            journal.renameTo(swapPathFor(filename));
+            watcher.watch(filename);
             drawMessage("File renamed successfully. :)");
         } else {
             drawMessage("Error: Failed to rename file! :(");
@@ -375,35 +4786,38 @@ void saveFile(const std::string &filename) {
         mvprintw(7, 1, "Ctrl+R: Rename file");
         mvprintw(8, 1, "Ctrl+O: Open another document");
         mvprintw(9,1, "Ctrl+C: Copy text");
-        mvprintw(10,1,  "Ctrl+V: Paste text");
-        mvprintw(11,1,  "Ctrl+Z: Undo changes");
-        mvprintw(12,1,   "Ctrl+Y: Redo changes");
-        mvprintw(13,1, "Ctrl+F: Find text");
-        mvprintw(14,1, "Ctrl+K: Replace text");
-        mvprintw(15,1, "Ctrl+D: Show date");
-        mvprintw(16,1, "Ctrl+T: Show time");
-        mvprintw(17,1, "Ctrl+P: Print document"); // This will use a Linux terminal application known as lpr.
-        mvprintw(18, 1, "Ctrl+X: Exit editor");
-        mvprintw(19, 1, "Press any key to return to the editor...");
+        mvprintw(10,1,  "Ctrl+V: Paste text, Alt+V: Paste from the desktop clipboard");
+        mvprintw(11,1,  "Alt+Y: Swap the paste for an earlier copy");
+        mvprintw(12,1,  "Ctrl+Z: Undo changes");
+        mvprintw(13,1,   "Ctrl+Y: Redo changes");
+        mvprintw(14,1, "Ctrl+F: Find text");
+        mvprintw(15,1, "Ctrl+K: Replace text");
+        mvprintw(16,1, "Ctrl+E: Reload file changed by another program");
+        mvprintw(17,1, "Ctrl+L: Go to line number");
+        mvprintw(18,1, "Ctrl+D: Show date");
+        mvprintw(19,1, "Ctrl+T: Show time");
+        mvprintw(20,1, "Ctrl+P: Print document"); // This will use a Linux terminal application known as lpr.
+        mvprintw(21, 1, "Ctrl+X: Exit editor");
+        mvprintw(22, 1, "Press any key to return to the editor...");
 
         attroff(COLOR_PAIR(3));
-        getch();
     }
-    void pushUndo() {
-        // Create a deep copy of the current content
-        std::vector<std::string> currentState;
-        currentState.reserve(content.size());
-        for (const auto& line : content) {
-            currentState.push_back(line);
-        }
 
-        // Only push if different from last undo state
-        if (undoStack.empty() || currentState != undoStack.top()) {
+    // Ctrl+H: the help menu is up until the next key.
+    Task<> showHelp() {
+        helpShown = true;
+        co_await nextKey();
+        helpShown = false;
+        clear();
+    }
+    void pushUndo() {
+        // Only push if different from last undo state, a copy is only made then
+        if (undoStack.empty() || content != undoStack.top()) {
             // Limit undo stack size
             if (undoStack.size() > 100) {
                 undoStack.pop();
             }
-            undoStack.push(currentState);
+            undoStack.push(content);
             // Clear redo stack whenever we push a new undo state
             while (!redoStack.empty()) {
                 redoStack.pop();
@@ -423,7 +4837,7 @@ void saveFile(const std::string &filename) {
             redoStack.push(currentState);
             
             // Restore from undo stack
-            content = undoStack.top();
+            setContent(undoStack.top());
             undoStack.pop();
             
             // Ensure cursor stays within bounds
@@ -434,7 +4848,6 @@ void saveFile(const std::string &filename) {
             if (cursorX >= viewX + COLS - 1){
                 viewX = cursorX - COLS + 2;
             }
-            isModified = true;
             refresh();
         } else {
             drawMessage("Error: Nothing to undo! :(");
@@ -453,14 +4866,13 @@ void saveFile(const std::string &filename) {
             undoStack.push(currentState);
             
             // Restore from redo stack
-            content = redoStack.top();
+            setContent(redoStack.top());
             redoStack.pop();
             
             // Ensure cursor stays within bounds
             cursorY = std::min(cursorY, (int)content.size() - 1);
             cursorX = std::min(cursorX, (int)content[cursorY].size());
             
-            isModified = true;
             refresh();
         } else {
             drawMessage("Error: Nothing to redo! :(");
@@ -468,6 +4880,8 @@ void saveFile(const std::string &filename) {
     }
     
     // This is the printing function - For printing documents. :)
+// Writes the text out and hands it to lpr on the thread pool, the result shows
+// up as a message once lpr is done.
 void printFile(const std::string &filename) {
     std::string tempPath = "/tmp/nemos_print_XXXXXX"; 
     
@@ -480,106 +4894,501 @@ void printFile(const std::string &filename) {
     
     // Set restrictive permissions (rw for owner only)
     fchmod(fd, S_IRUSR | S_IWUSR);
+    close(fd);
     
-    // Write content
-    std::ofstream tempFile(tempPath);
-    for (const auto& line : content) {
-        tempFile << line << "\n";
+    publishSnapshot();
+    auto reader = std::make_shared<SnapshotStore::Reader>(snapshots); // The text as it is now.
+    status.progress("print", "Printing...");
+    submitJob([this, reader, tempPath]() {
+        // Write content
+        std::ofstream tempFile(tempPath);
+        for (const auto& line : reader->text()) {
+            tempFile << line << "\n";
+        }
+        tempFile.close();
+
+        // Print and clean up, lpr must not write over the screen from back here
+        int result = system(("lpr " + tempPath + " </dev/null >/dev/null 2>&1").c_str());
+        
+        // Securely delete temporary file
+        std::remove(tempPath.c_str());
+        postToEditor([this, result]() {
+            status.progress("print", "");
+            if (result == 0) {
+                drawMessage("Document sent to the printer! :)");
+            } else {
+                drawMessage("Error: Failed to send document to the printer! :(");
+            }
+        });
+    }, ThreadPool::BACKGROUND);
+}
+
+// Runs job on the pool. The pool outlives the editor, so the editor counts
+// its jobs and waits for them before it goes away (cancelling what it can).
+void submitJob(std::function<void()> job, ThreadPool::Priority priority) {
+    {
+        std::lock_guard<std::mutex> lock(jobsMutex);
+        jobsRunning++;
     }
-    tempFile.close();
-    
-    // Print and clean up
-    int result = system(("lpr " + tempPath).c_str());
-    if (result == 0) {
-        drawMessage("Document sent to the printer! :)");
-    } else {
-        drawMessage("Error: Failed to send document to the printer! :(");
+    ThreadPool::shared().submit([this, job = std::move(job)]() mutable {
+        job();
+        job = nullptr; // What it holds (a snapshot reader) points into the editor too.
+        std::lock_guard<std::mutex> lock(jobsMutex);
+        if (--jobsRunning == 0) {
+            jobsDone.notify_all();
+        }
+    }, priority);
+}
+
+void waitForJobs() {
+    std::unique_lock<std::mutex> lock(jobsMutex);
+    jobsDone.wait(lock, [this]() { return jobsRunning == 0; });
+}
+
+// Runs fn on the editor thread the next time it wakes up, for jobs on the pool
+// that need to touch the text or the screen once they are done.
+void postToEditor(std::function<void()> fn) {
+    {
+        std::lock_guard<std::mutex> lock(completionMutex);
+        completions.push_back(std::move(fn));
     }
-    
-    // Securely delete temporary file
-    std::remove(tempPath.c_str());
+    uint64_t one = 1;
+    write(events.jobsDescriptor(), &one, sizeof(one));
+}
+
+bool runCompletions() {
+    std::vector<std::function<void()>> ready;
+    {
+        std::lock_guard<std::mutex> lock(completionMutex);
+        ready.swap(completions);
+    }
+    for (auto &fn : ready) {
+        fn();
+    }
+    return !ready.empty();
 }
 
 
         //This function will display the word count to the taskbar the the bottom. 
     int countWords(const std::string& text) {
-            std::istringstream stream(text);
-            std::string word;
-            int count = 0;
-            int totalWords = 0;
+            return countWords(text.data(), text.size());
+    }
 
-            
-            while (stream >> word) {
-                //count++; The code below will make it ignore punctionation meaning !, . and ? as those are not words.
-                word.erase(std::remove_if(word.begin(), word.end(), ::ispunct), word.end());
+    int countWords(const char *text, size_t size) {
+            WordCounter counter; // Scans in place, no copies.
+            counter.feed(text, size);
+            return counter.finish();
+    }
 
+    // Lines moved by PageUp and PageDown, one less than a screen so a line stays in view.
+    int pageHeight() const {
+        return std::max(1, LINES - 2);
+    }
+
+    // Scrolls the view just enough to show the cursor.
+    void showCursor() {
+        if (cursorY < viewY) viewY = cursorY;
+        if (cursorY >= viewY + LINES - 1) viewY = cursorY - LINES + 2;
+        if (cursorX < viewX) viewX = cursorX;
+        if (cursorX >= viewX + COLS - 1) viewX = cursorX - COLS + 2;
+        viewX = std::max(0, viewX);
+    }
+
+    // Puts the cursor on line y (clamped) in the column it had when up and down
+    // moves started, or at the end of the line if that one is shorter.
+    void moveToLine(int y) {
+        if (goalColumn < 0) {
+            goalColumn = cursorX;
+        }
+        cursorY = std::max(0, std::min(y, (int)content.size() - 1));
+        cursorX = std::min(goalColumn, (int)content[cursorY].size());
+        showCursor();
+    }
+
+    // The code ncurses gave a key from the terminal's terminfo entry, -1 if none.
+    static int keyCodeFor(const char *capability) {
+        char *sequence = tigetstr(const_cast<char *>(capability));
+        if (sequence == nullptr || sequence == (char *)-1) {
+            return -1;
+        }
+        int code = key_defined(sequence);
+        return code > 0 ? code : -1;
+    }
 
+    // The next key, like getch: the screen is brought up to date first, and
+    // waitMs -1 waits for ever, otherwise ERR if nothing came in time.
+    int readKey(int waitMs = -1) {
+        refresh();
+        if (latencyLog && !keyInput.pending()) {
+            logKeyLatency(); // What the keys so far did is on screen now.
+        }
+        if (!keysBack.empty()) {
+            int code = keysBack.back();
+            keysBack.pop_back();
+            return code;
+        }
+        auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(std::max(waitMs, 0));
+        while (true) {
+            handleSignals();
+            if (resizePending && std::chrono::steady_clock::now() >= resizeDue) {
+                resizePending = false;
+                struct winsize size;
+                if (ioctl(STDOUT_FILENO, TIOCGWINSZ, &size) == 0) {
+                    resizeterm(size.ws_row, size.ws_col);
+                }
+                return KEY_RESIZE;
+            }
+            KeyInput::Key key;
+            if (keyInput.pop(key)) {
+                if (latencyLog) {
+                    keysSinceFrame.push_back(key);
+                }
+                return key.code;
+            }
+            int left = waitMs < 0 ? -1 : std::max<long long>(0, std::chrono::duration_cast<std::chrono::milliseconds>(
+                deadline - std::chrono::steady_clock::now()).count());
+            if (resizePending) {
+                int resizeLeft = msUntilResize();
+                left = left < 0 ? resizeLeft : std::min(left, resizeLeft);
+            }
+            if (!events.waitForKeys(left)) {
+                if (resizePending && std::chrono::steady_clock::now() >= resizeDue) {
+                    continue;
+                }
+                return ERR;
+            }
+            keyInput.clearWake();
+        }
+    }
 
-                if (!word.empty()){
-                    count++; 
+    void handleSignals() {
+        while (int sig = events.takeSignal()) {
+            if (sig == SIGWINCH) {
+                auto now = std::chrono::steady_clock::now();
+                if (!resizePending) {
+                    resizePending = true;
+                    resizeLatest = now + std::chrono::milliseconds(250);
                 }
+                resizeDue = std::min(now + std::chrono::milliseconds(40), resizeLatest);
+            } else {
+                dieOfSignal(sig);
             }
+        }
+    }
 
-            return count;
+    int msUntilResize() {
+        return std::max<long long>(0, std::chrono::duration_cast<std::chrono::milliseconds>(
+            resizeDue - std::chrono::steady_clock::now()).count() + 1);
     }
 
-    void find() {
-        static std::vector<std::pair<int, size_t>> matches; // Stores line numbers and positions
-        static size_t currentMatch = 0;
-        static std::string lastSearch;
+    void unreadKey(int code) {
+        keysBack.push_back(code);
+    }
 
-        drawMessage("Find: ");
-        echo();
-        char searchStr[256];
-        int ch = getch();
+    // co_await nextKey() in a Task: the next key the editor loop gets.
+    struct KeyAwaiter {
+        NemoS *editor;
 
-        if (ch == 24) { // Control + X to cancel
-            matches.clear();
-            lastSearch.clear();
-            currentMatch = 0;
+        bool await_ready() const noexcept {
+            return false;
+        }
 
-            noecho();
-            return;
+        void await_suspend(std::coroutine_handle<> waiting) noexcept {
+            editor->keyWaiter = waiting;
         }
-        ungetch(ch);
-        getnstr(searchStr, sizeof(searchStr) - 1);
-        noecho();
 
-        if (strlen(searchStr) == 0) {
-            drawMessage("Find has been canceled!");
+        int await_resume() const noexcept {
+            return editor->keyForWaiter;
+        }
+    };
+
+    KeyAwaiter nextKey() {
+        return KeyAwaiter{this};
+    }
+
+    // Not a real key: wakes a prompt that waits for a job on the pool, see findAll.
+    static const int jobDoneKey = KEY_MAX + 1;
+
+    // Keys go to task until it is done. Most prompts are answered by a later key,
+    // one that needs none is already done and just dropped.
+    void startModal(Task<> task) {
+        if (!task.done()) {
+            modal = std::move(task);
+        }
+    }
+
+    void giveKeyToModal(int ch) {
+        if (keyWaiter) {
+            keyForWaiter = ch;
+            std::exchange(keyWaiter, nullptr).resume(); // Runs until it wants the next key.
+        }
+        if (modal.done()) {
+            modal = Task<>();
+        }
+    }
+
+    // A line of text typed after prompt, like getnstr. Nothing on Ctrl+X.
+    Task<std::optional<std::string>> readLine(std::string prompt, size_t size = 255) {
+        overlay.prompt = std::move(prompt);
+        overlay.answer.clear();
+        overlay.typing = true;
+        std::optional<std::string> text;
+        while (true) {
+            int ch = co_await nextKey();
+            if (ch == '\n' || ch == KEY_ENTER) {
+                text = overlay.answer;
+                break;
+            }
+            if (ch == 24) { // Ctrl+X
+                break;
+            }
+            if (ch == KEY_BACKSPACE || ch == 127 || ch == 8 || ch == KEY_LEFT) {
+                if (!overlay.answer.empty()) {
+                    overlay.answer.pop_back();
+                }
+            } else if (ch >= 32 && ch < 256 && overlay.answer.size() < size) {
+                overlay.answer += (char)ch;
+            }
+        }
+        overlay.prompt.clear();
+        overlay.answer.clear();
+        overlay.typing = false;
+        co_return text;
+    }
+
+    // With NEMOS_KEY_LATENCY set to a file, writes how long each key took from
+    // coming off the tty to being on screen, one "key microseconds" per line.
+    void logKeyLatency() {
+        auto now = std::chrono::steady_clock::now();
+        for (const auto &key : keysSinceFrame) {
+            fprintf(latencyLog, "%d %lld\n", key.code,
+                    (long long)std::chrono::duration_cast<std::chrono::microseconds>(now - key.arrived).count());
+        }
+        keysSinceFrame.clear();
+        fflush(latencyLog);
+    }
+
+    // Ctrl+V pastes our newest copy straight away, no other program involved.
+    // Only with nothing copied in NemoS yet is the desktop clipboard asked.
+    void paste() {
+        if (!killRing.empty() || !startClipboardPaste()) {
+            pasteNewestCopy();
+        }
+    }
+
+    // Alt+V, for text copied in another program. While a copy of ours is still
+    // on its way to the desktop, the desktop holds something older than it.
+    void pasteFromDesktop() {
+        if (systemCopiesRunning > 0) {
+            pasteNewestCopy();
+        } else if (!startClipboardPaste()) {
+            drawMessage("Error: There is no desktop clipboard to paste from (wl-paste or xclip). :(");
+        }
+    }
+
+    void pasteNewestCopy() {
+        if (killRing.empty()) {
+            drawMessage("Error: Clipboard empty or could not be accessed.");
             return;
         }
+        pushUndo();
+        pasteText(killRing.at(0));
+        lastPaste.ringIndex = 0;
+    }
 
-        // If this is a new search, find all matches
-        if (lastSearch != searchStr) {
-            matches.clear();
-            lastSearch = searchStr;
-            
-            // Search entire document
-            for (size_t i = 0; i < content.size(); i++) {
-                size_t pos = 0;
-                while ((pos = content[i].find(searchStr, pos)) != std::string::npos) {
-                    matches.emplace_back(i, pos);
-                    pos += strlen(searchStr);
+    // Starts reading the desktop clipboard, for text copied in another program.
+    // It comes in on its own thread, readClipboard pastes it once it's all here.
+    bool startClipboardPaste() {
+        if (clipboardPid > 0) {
+            kill(-clipboardPid, SIGKILL); // The last one still hasn't exited, it had its chance.
+            waitpid(clipboardPid, nullptr, 0);
+        }
+        const char *command = systemClipboardCommand(true);
+        int fd;
+        clipboardPid = command ? spawnWithPipe(command, false, fd) : -1;
+        if (clipboardPid < 0) {
+            return false;
+        }
+        clipboardText.clear();
+        clipboardDeadline = std::chrono::steady_clock::now() + clipboardTimeout();
+        clipboardReader.start(fd);
+        return true;
+    }
+
+    void cancelClipboardPaste() {
+        kill(-clipboardPid, SIGKILL);
+        waitpid(clipboardPid, nullptr, 0);
+        clipboardPid = -1;
+        clipboardReader.stop();
+        clipboardText = std::string();
+    }
+
+    // Collects what the clipboard program sent so far and pastes it, as one
+    // edit, once it is done. Returns true if the screen needs drawing again.
+    bool readClipboard() {
+        reapClipboardProgram();
+        if (!clipboardReader.running()) {
+            return false;
+        }
+        std::string arrived;
+        bool open = clipboardReader.take(arrived, 4 << 20);
+        clipboardText += arrived;
+        if (open && std::chrono::steady_clock::now() >= clipboardDeadline) {
+            cancelClipboardPaste();
+            drawMessage("Error: The clipboard did not answer in time, nothing was pasted. :(");
+            return true;
+        }
+        if (!open) {
+            std::string text = std::move(clipboardText);
+            clipboardText = std::string();
+            if (!text.empty()) {
+                if (killRing.empty() || text != killRing.at(0)) {
+                    killRing.push(text); // Ctrl+V pastes it again from now on, Alt+Y still reaches ours.
                 }
+                pushUndo();
+                pasteText(text);
+                lastPaste.ringIndex = 0;
+            } else {
+                drawMessage("Clipboard is empty or no owner for the clipboard selection.");
             }
-            
-            if (matches.empty()) {
-                drawMessage("Error: Text has not been found! :(");
-                return;
+            reapClipboardProgram();
+            return true;
+        }
+        return !arrived.empty();
+    }
+
+    // All the text is here once the pipe closes, the program exiting isn't waited
+    // for. One that closed its end and hangs is checked on every pass of the loop
+    // instead, and killed at its deadline.
+    void reapClipboardProgram() {
+        if (clipboardPid <= 0 || clipboardReader.running()) {
+            return;
+        }
+        if (waitpid(clipboardPid, nullptr, WNOHANG) != 0) {
+            clipboardPid = -1;
+        } else if (std::chrono::steady_clock::now() >= clipboardDeadline) {
+            kill(-clipboardPid, SIGKILL);
+            waitpid(clipboardPid, nullptr, 0);
+            clipboardPid = -1;
+        }
+    }
+
+    // Puts text in at the cursor and leaves the cursor after it.
+    void pasteText(const std::string &text) {
+        // Split text into lines, a newline at the very end doesn't start another one.
+        std::vector<std::string> lines = splitAtNewlines(text);
+        if (lines.size() > 1 && lines.back().empty()) {
+            lines.pop_back();
+        }
+
+        // Insert the lines at the cursor, the rest of the line goes after the last one
+        size_t afterCursor = content[cursorY].size() - cursorX;
+        lastPaste.y = cursorY;
+        lastPaste.x = cursorX;
+        size_t count = lines.size();
+        insertLines(cursorY, cursorX, std::move(lines));
+
+        // Update cursor position to the end of the pasted text
+        cursorY = cursorY + count - 1;
+        cursorX = content[cursorY].size() - afterCursor;
+        showCursor();
+        lastPaste.endY = cursorY;
+        lastPaste.endX = cursorX;
+        lastPaste.version = editVersion;
+    }
+
+    // Alt+Y right after a paste: swaps the pasted text for the copy before it.
+    void yankPop() {
+        if (lastPaste.version != editVersion || killRing.size() < 2) {
+            drawMessage("Error: Alt+Y only works right after pasting, with more than one copy! :(");
+            return;
+        }
+        eraseRange(lastPaste.y, lastPaste.x, lastPaste.endY, lastPaste.endX);
+        cursorY = lastPaste.y;
+        cursorX = lastPaste.x;
+        size_t index = lastPaste.ringIndex + 1;
+        pasteText(killRing.at(index)); // Same undo step as the paste.
+        lastPaste.ringIndex = index;
+    }
+
+    Task<> goToLine() {
+        std::optional<std::string> lineInput = co_await readLine("Go to line number (or 50%, or b1234 for a byte): ");
+
+        if (!lineInput || lineInput->empty()) { // Ctrl+X or nothing typed
+            drawMessage("Go to line number has been canceled!");
+            co_return;
+        }
+
+        JumpKind kind;
+        uint64_t value;
+        if (!parseJump(*lineInput, kind, value)) {
+            drawMessage("Error: Please enter a valid line number! :(");
+            co_return;
+        }
+
+        int targetLine = 0, targetColumn = 0;
+        if (kind == JUMP_LINE) {
+            if (value < 1 || value > content.size()) {
+                std::string msg = "Error: Line number " + std::to_string(value) +
+                                " is out of range! (1-" + std::to_string(content.size()) + ") :(";
+                drawMessage(msg.c_str());
+                co_return;
             }
-            
-            currentMatch = 0;
+            targetLine = value - 1;
+        } else if (kind == JUMP_PERCENT) {
+            targetLine = std::min<uint64_t>(content.size() - 1, content.size() * value / 100);
         } else {
-            // If same search, cycle through matches
-            currentMatch = (currentMatch + 1) % matches.size();
+            positionOfByte(value, targetLine, targetColumn); // O(log n), see LineOffsets.
         }
 
-        // Highlight the current match
-        cursorY = matches[currentMatch].first;
-        cursorX = matches[currentMatch].second;
-        
-        // Center the view
+        // Jump to the target line
+        cursorY = targetLine;
+        cursorX = targetColumn;
+        viewX = std::max(0, cursorX - (COLS - 2));
+
+        // Center the view on the target line
+        viewY = std::max(0, cursorY - (LINES - 2) / 2);
+
+        std::string msg = "Jumped to line number " + std::to_string(targetLine + 1) + " :)";
+        drawMessage(msg.c_str());
+    }
+
+    // Every place needle is in the text, in order. A snapshot is searched on the
+    // pool so the editor keeps going meanwhile; Ctrl+X stops it and gives nothing.
+    // The text can't change under the search, keys go to the prompt until it's done.
+    Task<std::optional<std::vector<std::pair<int, size_t>>>> findAll(std::string needle) {
+        searchCancel->store(true);
+        searchCancel = ThreadPool::newToken();
+        auto cancel = searchCancel;
+        auto found = std::make_shared<std::optional<std::vector<std::pair<int, size_t>>>>();
+        publishSnapshot();
+        auto reader = std::make_shared<SnapshotStore::Reader>(snapshots);
+        submitJob([this, reader, needle, cancel, found]() {
+            std::vector<std::pair<int, size_t>> matches = reader->text().findAll(needle, cancel);
+            postToEditor([this, cancel, found, matches = std::move(matches)]() mutable {
+                if (!cancel->load()) {
+                    *found = std::move(matches);
+                    giveKeyToModal(jobDoneKey);
+                }
+                snapshots.collect();
+            });
+        }, ThreadPool::INTERACTIVE);
+
+        overlay.prompt = "Searching... Ctrl+X: Cancel";
+        while (!*found) {
+            if (co_await nextKey() == 24) {
+                cancel->store(true);
+                break;
+            }
+        }
+        overlay.prompt.clear();
+        co_return std::move(*found);
+    }
+
+    // Puts the cursor on y, x with the view around it, for showing a match.
+    void centerOn(int y, int x) {
+        cursorY = y;
+        cursorX = x;
         viewY = std::max(0, cursorY - LINES/3);
         if (cursorY >= viewY + LINES - 1) {
             viewY = cursorY - LINES + 2;
@@ -588,109 +5397,111 @@ void printFile(const std::string &filename) {
         if (cursorX >= viewX + COLS - 1) {
             viewX = cursorX - COLS + 2;
         }
-        
-        // Show navigation instructions
-        std::string msg = "Match " + std::to_string(currentMatch + 1) + " of " + 
-                        std::to_string(matches.size()) + " (left and right arrow keys to navigate)";
-        drawMessage(msg.c_str());
-        
-        // Allow navigation through matches with arrow keys
-        while (true) {
-            clear();
-            // Redraw content
-            for (int i = 0; i < LINES - 1; ++i) {
-                int lineIndex = i + viewY;
-                if (lineIndex < content.size()) {
-                    mvprintw(i, 0, "%s", content[lineIndex].substr(viewX, COLS - 1).c_str());
-                }
-                clrtoeol();
-            }
-            
-            // Highlight current match
-            move(cursorY - viewY, cursorX - viewX);
-            attron(A_REVERSE);
-            addstr(lastSearch.c_str());
-            attroff(A_REVERSE);
-            
-            // Redraw status bar
-            attron(COLOR_PAIR(2));
-            mvprintw(LINES - 1, 0, "Match %d/%d - left and right arrow keys: Navigate | Enter: Exit", 
-                    currentMatch + 1, matches.size());
-            attroff(COLOR_PAIR(2));
-            
-            refresh();
-            
-            int nav = getch();
-            switch (nav) {
-                case KEY_LEFT:
-                    currentMatch = (currentMatch == 0) ? matches.size() - 1 : currentMatch - 1;
-                    break;
-                case KEY_RIGHT:
-                    currentMatch = (currentMatch + 1) % matches.size();
-                    break;
-                case '\n':
-                    return; // Exit search navigation
-                default:
-                    continue;
+    }
+
+    Task<> find() {
+        static std::vector<std::pair<int, size_t>> matches; // Stores line numbers and positions
+        static size_t currentMatch = 0;
+        static std::string lastSearch;
+
+        std::optional<std::string> searchStr = co_await readLine("Find: ");
+
+        if (!searchStr) { // Control + X to cancel
+            matches.clear();
+            lastSearch.clear();
+            currentMatch = 0;
+            co_return;
+        }
+
+        if (searchStr->empty()) {
+            drawMessage("Find has been canceled!");
+            co_return;
+        }
+
+        // If this is a new search, find all matches
+        if (lastSearch != *searchStr) {
+            matches.clear();
+            lastSearch.clear();
+
+            // Search entire document
+            std::optional<std::vector<std::pair<int, size_t>>> found = co_await findAll(*searchStr);
+            if (!found) {
+                drawMessage("Find has been canceled!");
+                co_return;
             }
-            
-            // Update position to new match
-            cursorY = matches[currentMatch].first;
-            cursorX = matches[currentMatch].second;
-            
-            // Adjust view
-            viewY = std::max(0, cursorY - LINES/3);
-            if (cursorY >= viewY + LINES - 1) {
-                viewY = cursorY - LINES + 2;
+            matches = std::move(*found);
+            lastSearch = *searchStr;
+
+            if (matches.empty()) {
+                drawMessage("Error: Text has not been found! :(");
+                co_return;
             }
-            viewX = std::max(0, cursorX - COLS/3);
-            if (cursorX >= viewX + COLS - 1) {
-                viewX = cursorX - COLS + 2;
+            
+            currentMatch = 0;
+        } else {
+            // If same search, cycle through matches
+            currentMatch = (currentMatch + 1) % matches.size();
+        }
+
+        // Show navigation instructions
+        std::string msg = "Match " + std::to_string(currentMatch + 1) + " of " + 
+                        std::to_string(matches.size()) + " (left and right arrow keys to navigate)";
+        drawMessage(msg.c_str());
+        
+        // Allow navigation through matches with arrow keys, drawFrame highlights the current one.
+        overlay.matchLength = lastSearch.size();
+        while (true) {
+            centerOn(matches[currentMatch].first, matches[currentMatch].second);
+            overlay.matchY = cursorY;
+            overlay.matchX = cursorX;
+            overlay.bar = "Match " + std::to_string(currentMatch + 1) + "/" + std::to_string(matches.size()) +
+                          " - left and right arrow keys: Navigate | Enter: Exit";
+
+            int nav = co_await nextKey();
+            if (nav == KEY_LEFT) {
+                currentMatch = (currentMatch == 0) ? matches.size() - 1 : currentMatch - 1;
+            } else if (nav == KEY_RIGHT) {
+                currentMatch = (currentMatch + 1) % matches.size();
+            } else if (nav == '\n') {
+                break; // Exit search navigation
             }
         }
+        overlay.matchY = -1;
+        overlay.bar.clear();
     }
 
     // This function is very good as it will allow you to replace text - Useful when it comes to programming...
-    void Replace() {
-        drawMessage("Find: ");
-        echo();
-        char searchStr[256];
-        int ch = getch();
-
-        if (ch == 24) { // Control + X to cancel
-            noecho();
-            return;
+    Task<> Replace() {
+        std::optional<std::string> searchStr = co_await readLine("Find: ");
+
+        if (!searchStr) { // Control + X to cancel
+            co_return;
         }
-        ungetch(ch);
-        getnstr(searchStr, sizeof(searchStr) - 1);
         
-        if (strlen(searchStr) == 0) {
-            noecho();
+        if (searchStr->empty()) {
             drawMessage("Replace has been canceled!");
-            return;
+            co_return;
         }
 
-        drawMessage("Replace with: ");
-        char replaceStr[256];
-        getnstr(replaceStr, sizeof(replaceStr) - 1);
-        noecho();
+        std::optional<std::string> replaceStr = co_await readLine("Replace with: ");
+        if (!replaceStr) {
+            drawMessage("Replace has been canceled!");
+            co_return;
+        }
 
         int replaceCount = 0;
         bool replaced = false;
-        std::vector<std::pair<int, size_t>> matches;
-
         // First find all matches
-        for (size_t i = 0; i < content.size(); i++) {
-            size_t pos = 0;
-            while ((pos = content[i].find(searchStr, pos)) != std::string::npos) {
-                matches.emplace_back(i, pos);
-                pos += strlen(searchStr);
-            }
+        std::optional<std::vector<std::pair<int, size_t>>> found = co_await findAll(*searchStr);
+        if (!found) {
+            drawMessage("Replace has been canceled!");
+            co_return;
         }
+        std::vector<std::pair<int, size_t>> matches = std::move(*found);
 
         if (matches.empty()) {
             drawMessage("Error: No matches found! :(");
-            return;
+            co_return;
         }
 
         // Store original state for undo
@@ -699,38 +5510,25 @@ void printFile(const std::string &filename) {
         // Process each match
         for (size_t matchIdx = 0; matchIdx < matches.size(); matchIdx++) {
             auto [i, pos] = matches[matchIdx];
-            cursorY = i;
-            cursorX = pos;
-            
-            // Center view
-            viewY = std::max(0, cursorY - LINES/3);
-            viewX = std::max(0, cursorX - COLS/3);
+            centerOn(i, pos);
             
             // Highlight match
-            clear();
-            for (int y = 0; y < LINES - 1; y++) {
-                int lineIdx = y + viewY;
-                if (lineIdx < content.size()) {
-                    mvprintw(y, 0, "%s", content[lineIdx].substr(viewX, COLS - 1).c_str());
-                }
-            }
-            
-            move(cursorY - viewY, cursorX - viewX);
-            attron(A_REVERSE);
-            addstr(searchStr);
-            attroff(A_REVERSE);
+            overlay.matchY = i;
+            overlay.matchX = pos;
+            overlay.matchLength = searchStr->size();
             
             std::string prompt = "Replace? ([y]es/[n]o/[a]ll/[q]uit) [";
             prompt += std::to_string(matchIdx + 1);
             prompt += "/";
             prompt += std::to_string(matches.size());
             prompt += "]";
-            drawMessage(prompt.c_str());
+            overlay.prompt = prompt;
+            overlay.typing = true;
             
-            int answer = tolower(getch());
+            int answer = tolower(co_await nextKey());
             switch (answer) {
                 case 'y':
-                    content[i].replace(pos, strlen(searchStr), replaceStr);
+                    replaceText(i, pos, searchStr->size(), *replaceStr);
                     replaceCount++;
                     replaced = true;
                     break;
@@ -738,7 +5536,7 @@ void printFile(const std::string &filename) {
                     // Replace all remaining
                     for (; matchIdx < matches.size(); matchIdx++) {
                         auto [j, p] = matches[matchIdx];
-                        content[j].replace(p, strlen(searchStr), replaceStr);
+                        replaceText(j, p, searchStr->size(), *replaceStr);
                         replaceCount++;
                     }
                     replaced = true;
@@ -752,12 +5550,14 @@ void printFile(const std::string &filename) {
                     break;
             }
         }
+        overlay.matchY = -1;
+        overlay.prompt.clear();
+        overlay.typing = false;
 
         if (replaced) {
             std::string msg = "Replaced ";
             msg += std::to_string(replaceCount);
             msg += " occurrence(s)";
-            isModified = true;
             drawMessage(msg.c_str());
         } else {
             // If no replacements made, pop the undo state we pushed earlier
@@ -767,104 +5567,396 @@ void printFile(const std::string &filename) {
             drawMessage("No replacements made.");
         }
     }    
-    void drawEditor(std::string &filename) {
-        bool running = true;
-        //int viewX = 0, viewY = 0; // Tracks the visible area (scroll position)
-        //std::thread timeThread(&NemoS::LiveTime, this);  // Pass 'this' to use the member function        timeThread.detach();
-        while (running) {
-            std::string fullText;
-            for (const auto& line : content){
-                fullText += line + " ";
-            }
-
-
-            int wordCount = countWords(fullText);
-            //Will find out the file size for the nav bar.
-            std::string FileSize = getFileSize(filename); // This will get the file size. :)
-            //clear();
-            // Draw the editor content
-            for (int i = 0; i < LINES - 1; ++i) {
-                move(i, 0);
-                //clrtoeol();
-                int lineIndex = i + viewY; // The actual index in the content vector
-
-            if (lineIndex < content.size()) {
-                std::string line = content[lineIndex];
-
-                int availableLength = line.size();
-                int charsToPrint = std::min(availableLength, COLS - 1);
-                int startPos = 0;
-
-                if (lineIndex == cursorY) { // Current line
-                    bool TextOffLeft = false;
-                    availableLength -= viewX;
-                    charsToPrint = std::min(availableLength, COLS - 1);
-                    startPos = viewX;
-                    if (startPos >= line.size()){
-                        startPos = line.size() > 0 ? line.size() -1 : 0;
+    // Ctrl+O
+    Task<> openFile(std::string &filename) {
+        std::optional<std::string> newFilename = co_await readLine("Enter filename to open: ");
+        if (!newFilename) {
+            co_return;
+        }
+
+        if (!isSafePath(*newFilename)) {
+            drawMessage("Error: Invalid file path! :(");
+            co_return;
+        }
+
+        // Check if file exists and is readable
+        if (!checkPermission(*newFilename, EXISTS)) {
+            drawMessage("Error: File doesn't exist! :(");
+            co_return;
+        }
+        if (!checkPermission(*newFilename, READABLE)) {
+            drawMessage("Error: No read permission! :(");
+            co_return;
+        }
+
+        // Save current file if modified
+        if (isModified && co_await askYesNo("Do you want to save the current file first? (Y/N): ")) {
+            saveFile(filename);
+        }
+
+        // Load new file
+        filename = *newFilename;
+        waitForSave(); // Its swap file is rebased when the save finishes.
+        journal.close(true);
+        loadFile(filename);
+        cursorX = 0;
+        cursorY = 0;
+        viewX = 0;
+        viewY = 0;
+        watcher.watch(filename);
+        co_await startJournal(filename);
+    }
+
+    // Ctrl+C: the arrow keys move the cursor and drawFrame shows what is selected
+    // between where it started and where it is.
+    Task<> copyMode() {
+        if (content.empty() || cursorY >= (int)content.size()) {
+            co_return;
+        }
+        overlay.selecting = true;
+        overlay.anchorY = cursorY;
+        overlay.anchorX = cursorX;
+        overlay.prompt = "Copy Mode: Use arrow keys to select, Ctrl+C to copy, Ctrl+X to cancel!";
+        bool selecting = true;
+        while (selecting) {
+            int ch = co_await nextKey();
+            switch (ch) {
+                case KEY_LEFT:
+                    if (cursorX > 0) cursorX--;
+                    break;
+                case KEY_RIGHT:
+                    if (cursorX < (int)content[cursorY].size()) cursorX++;
+                    break;
+                case KEY_UP:
+                    if (cursorY > 0) {
+                        cursorY--;
+                        cursorX = std::min(cursorX, (int)content[cursorY].size());
+                    }
+                    break;
+                case KEY_DOWN:
+                    if (cursorY < (int)content.size() - 1) {
+                        cursorY++;
+                        cursorX = std::min(cursorX, (int)content[cursorY].size());
+                    }
+                    break;
+                case 3: { // Ctrl+C to copy
+                    std::string selectedText;
+                    int startY = overlay.anchorY, startX = overlay.anchorX;
+                    int endY = cursorY, endX = cursorX;
+                    int firstY = std::min(startY, endY);
+                    int lastY = std::max(startY, endY);
+                    
+                    for (int y = firstY; y <= lastY; y++) {
+                        if (y >= (int)content.size()) break;
+                        
+                        int lineStart = (y == firstY) ? 
+                            ((firstY == startY) ? startX : endX) : 0;
+                        int lineEnd = (y == lastY) ? 
+                            ((lastY == endY) ? endX : startX) : content[y].size();
+                            
+                        if (lineStart > lineEnd) std::swap(lineStart, lineEnd);
+                        
+                        if (lineStart < (int)content[y].size()) {
+                            selectedText += content[y].substr(lineStart, lineEnd - lineStart);
+                        }
+                        
+                        if (y < lastY) selectedText += "\n";
+                    }
+                    
+                    killRing.push(selectedText);
+                    if (!copyToSystemClipboard(selectedText)) {
+                        copyToTerminalClipboard(selectedText);
                     }
-                    std::string visibleLine = line.substr(startPos, charsToPrint); // Create the visible line
+                    drawMessage("Selected text copied to clipboard! :)");
+                    selecting = false;
+                    break;
+                }
+                case 24: // Ctrl+X to cancel
+                    selecting = false;
+                    break;
+            }
+            showCursor(); // Keep the selection visible
+        }
+        overlay.selecting = false;
+        overlay.prompt.clear();
+    }
 
-                    TextOffLeft = (viewX > 0 && visibleLine.find_first_not_of(" \t\n\r") != std::string::npos); // Use visibleLine's size
-                    attron(COLOR_PAIR(1));
-                    mvprintw(i, 0, "%s", line.substr(startPos, charsToPrint).c_str());
-                    attroff(COLOR_PAIR(1));
-                    clrtoeol(); 
-                    if (TextOffLeft) {
-                        attron(COLOR_PAIR(3)); // Use a color pair for the arrow
-                        mvaddch(i, 0, '<');    // Draw the arrow at the left edge
-                        attroff(COLOR_PAIR(3));
+    // True for the broken compressed file the buffer only has part of, under any name.
+    bool isPartlyRead(const std::string &filename) {
+        struct stat info;
+        return partlyRead && stat(resolveSymlinks(filename).c_str(), &info) == 0 &&
+               info.st_dev == partlyReadInfo.st_dev && info.st_ino == partlyReadInfo.st_ino;
+    }
+
+    // Ctrl+S on a file that was only partly read: the text goes to a new file,
+    // which is the one being edited from then on.
+    Task<> saveUnderNewName(std::string &filename) {
+        std::optional<std::string> newFilename = co_await readLine("Only part of the file was read. Save it as: ");
+        if (!newFilename || newFilename->empty()) {
+            co_return;
+        }
+        if (!isSafePath(*newFilename)) {
+            drawMessage("Error: Invalid file path! :(");
+            co_return;
+        }
+        if (isPartlyRead(*newFilename)) {
+            drawMessage("Error: That is the file that was only partly read! :(");
+            co_return;
+        }
+        if (checkPermission(*newFilename, EXISTS) &&
+            !co_await askYesNo("The file " + *newFilename + " already exists. Save over it? (Y/N)")) {
+            co_return;
+        }
+        filename = *newFilename;
+        fileCompression = compressionForName(filename);
+        diskLayoutKnown = false;
+        journal.renameTo(swapPathFor(filename));
+        watcher.watch(filename);
+        autosave.setPaused(false);
+        saveFile(filename);
+    }
+
+    // Ctrl+S after another program changed the file.
+    Task<> saveOverChange(std::string filename) {
+        if (co_await askYesNo("The file was changed by another program. Save over it? (Y/N)")) {
+            saveFile(filename);
+        }
+    }
+
+    // Ctrl+X
+    Task<> leaveEditor() {
+        if (saveRunning) {
+            attron(COLOR_PAIR(2));
+            mvprintw(LINES - 2, 0, "Waiting for the save to finish...");
+            clrtoeol();
+            attroff(COLOR_PAIR(2));
+            refresh();
+            waitForSave(); // The file must be fully written before we go.
+        }
+        if (isModified) {
+            running = !co_await askYesNo("Warning: Are you sure you want to leave without saving? (Y/N)");
+        } else {
+            running = false;
+        }
+    }
+
+    // Changes how columns from..to of line y look, wherever that line is on screen.
+    void paintSpan(int y, int from, int to, attr_t attrs, short pair) {
+        if (y < viewY || y >= viewY + LINES - 1) {
+            return;
+        }
+        int shift = (y == cursorY) ? viewX : 0; // Only the cursor line scrolls sideways.
+        from = std::max(from - shift, 0);
+        to = std::min(to - shift, COLS - 1);
+        if (from < to) {
+            mvchgat(y - viewY, from, to - from, attrs, pair, nullptr);
+        }
+    }
+
+    // The one place the screen is drawn, prompts only change what goes in it.
+    void drawFrame(const std::string &filename) {
+        if (helpShown) {
+            drawHelp();
+            refresh();
+            return;
+        }
+        // Counting every word is slow on big files, so after an edit a snapshot is
+        // counted on the pool and the last count shows until it's done. Blocks keep
+        // their count, only the ones with changed lines are counted again. A count
+        // of text that has been edited since is cancelled for a new one.
+        if (wordCountVersion != editVersion && wordCountFor != editVersion) {
+            wordCountCancel->store(true);
+            wordCountCancel = ThreadPool::newToken();
+            wordCountFor = editVersion;
+            publishSnapshot();
+            auto reader = std::make_shared<SnapshotStore::Reader>(snapshots);
+            auto cancel = wordCountCancel;
+            submitJob([this, reader, cancel]() {
+                uint64_t words = reader->text().wordCount(cancel);
+                uint64_t counted = reader->text().number;
+                postToEditor([this, words, counted, cancel]() {
+                    if (!cancel->load()) {
+                        wordCountFor = UINT64_MAX;
+                        // Thrown away if the text changed meanwhile, the next frame counts again.
+                        if (counted == snapshots.latest().number && snapshotDirty.empty() && snapshotStaleFrom == INT_MAX) {
+                            cachedWordCount = words;
+                            wordCountVersion = editVersion;
+                        }
                     }
-                } else { // Other lines
-                    move(i, 0); // Essential!
+                    snapshots.collect();
+                });
+            }, ThreadPool::BACKGROUND);
+        }
+        unsigned long long wordCount = cachedWordCount;
+        //Will find out the file size for the nav bar.
+        std::string FileSize = getFileSize(filename); // This will get the file size. :)
+        //clear();
+        // Draw the editor content. Every row is written in full, so a resize only
+        // needs a new frame, and nothing is copied: each row prints straight from
+        // its line, at most a screen width of it.
+        for (int i = 0; i < LINES - 1; ++i) {
+            int lineIndex = i + viewY; // The actual index in the content vector
+
+        if (lineIndex < content.size()) {
+            const std::string &line = content[lineIndex];
 
-                    mvprintw(i, 0, "%s", line.substr(0, charsToPrint).c_str());
-                    clrtoeol();
+            int availableLength = line.size();
+            int charsToPrint = std::min(availableLength, COLS - 1);
+            int startPos = 0;
+
+            if (lineIndex == cursorY) { // Current line
+                availableLength -= viewX;
+                charsToPrint = std::max(0, std::min(availableLength, COLS - 1));
+                startPos = viewX;
+                if (startPos >= line.size()){
+                    startPos = line.size() > 0 ? line.size() -1 : 0;
                 }
-            } else {
-                clrtoeol(); // Clear any remaining content on empty lines
-            }
-                
-                bool lineExists = (i + viewY < content.size());
-                bool lineHasText = lineExists && (content[i + viewY].find_first_not_of(" \t\n\r") != std::string::npos); // Check if line has non-space characters
-                //bool TextOffLeft = (viewX > 0 && lineHasText);
-                bool TextOffRight = (i + viewY < content.size() && content[i + viewY].size() > viewX + COLS - 1);
+                std::string_view visibleLine = std::string_view(line).substr(startPos, charsToPrint);
 
-                if (TextOffRight){
-                    attron(COLOR_PAIR(3));
-                    mvaddch(i, COLS - 1, '>');                    
+                bool TextOffLeft = (viewX > 0 && visibleLine.find_first_not_of(" \t\n\r") != std::string_view::npos);
+                attron(COLOR_PAIR(1));
+                mvaddnstr(i, 0, visibleLine.data(), visibleLine.size());
+                attroff(COLOR_PAIR(1));
+                clrtoeol(); 
+                if (TextOffLeft) {
+                    attron(COLOR_PAIR(3)); // Use a color pair for the arrow
+                    mvaddch(i, 0, '<');    // Draw the arrow at the left edge
                     attroff(COLOR_PAIR(3));
                 }
+            } else { // Other lines
+                mvaddnstr(i, 0, line.data(), charsToPrint);
+                clrtoeol();
+            }
+            if (line.size() > viewX + COLS - 1) {
+                attron(COLOR_PAIR(3));
+                mvaddch(i, COLS - 1, '>');
+                attroff(COLOR_PAIR(3));
+            }
+        } else {
+            move(i, 0);
+            clrtoeol(); // Clear any remaining content on empty lines
+        }
+
+        }
 
+        // What a prompt marks in the text: a match, or the copy mode selection.
+        if (overlay.matchY >= 0) {
+            paintSpan(overlay.matchY, overlay.matchX, overlay.matchX + overlay.matchLength, A_REVERSE, 0);
+        }
+        if (overlay.selecting) {
+            int fromY = overlay.anchorY, fromX = overlay.anchorX, toY = cursorY, toX = cursorX;
+            if (toY < fromY || (toY == fromY && toX < fromX)) {
+                std::swap(fromY, toY);
+                std::swap(fromX, toX);
+            }
+            for (int y = std::max(fromY, viewY); y <= toY && y < viewY + LINES - 1; y++) {
+                paintSpan(y, y == fromY ? fromX : 0, y == toY ? toX : content[y].size(), A_NORMAL, 4);
             }
+        }
 
-            // Draw the status bar at the bottom
-            move(LINES - 1, 0); // Move to the last line
-            clrtoeol(); // Clear the status bar line
-            attron(COLOR_PAIR(2));
+        // Draw the status bar at the bottom
+        move(LINES - 1, 0); // Move to the last line
+        clrtoeol(); // Clear the status bar line
+        attron(COLOR_PAIR(2));
 
 
 
-            //The bottom navigation bar!!!
-            mvprintw(LINES - 1, 0, "NemoS 4.0 | File: %s %s| File Size: %s | Word Count: %d | Line: %d | Column: %d | Ctrl+H: Help | Ctrl+X: Exit ", 
+        //The bottom navigation bar!!!
+        int statusY = std::min(cursorY, (int)content.size() - 1);
+        unsigned long long bytePosition = byteOffsetOf(statusY, std::min(cursorX, (int)content[statusY].size()));
+        if (!overlay.bar.empty()) {
+            mvprintw(LINES - 1, 0, "%s", overlay.bar.substr(0, COLS - 1).c_str());
+        } else {
+            mvprintw(LINES - 1, 0, "NemoS 4.0 | File: %s %s%s| File Size: %s | Word Count: %llu | Line: %d | Column: %d | Byte: %llu | Ctrl+H: Help | Ctrl+X: Exit ", 
                 filename.c_str(), 
                 isModified ? "[Modified] " : "",  // This will show "[Modified]" when changes are made but the user did not save yet. 
+                changedOnDisk ? "[Changed on disk, Ctrl+E: Reload] " :
+                followMode ? "[Following] " : "",
                 FileSize.c_str(),
                 wordCount, 
                 cursorY + 1, 
-                cursorX + 1); 
-            attroff(COLOR_PAIR(2));
-            cursorX = std::min(cursorX, (int)content[cursorY].size());
-            cursorY = std::min(cursorY, (int)content.size() -1);
-            // Place the cursor in the correct position
+                cursorX + 1,
+                bytePosition); 
+        }
+        attroff(COLOR_PAIR(2));
+        // Place the cursor in the correct position
+        // Background jobs say how far they are on the message line.
+        status.progress("save", saveRunning ? "Saving..." : "");
+        status.progress("load", !streamReader.running() ? "" :
+                        (inputFd >= 0 ? "Reading stdin... " : fileCompression != COMPRESSION_NONE ? "Unpacking... " : "Loading... ") +
+                        formatSize(streamBytes));
+        status.progress("paste", clipboardReader.running() ? "Pasting " + formatSize(clipboardText.size()) + ", Ctrl+X: Cancel" : "");
+        if (!overlay.prompt.empty()) {
+            drawPrompt(overlay.prompt + overlay.answer);
+        } else if (clockShown) {
+            drawPrompt("The time is: " + getCurrentTime());
+        } else {
+            drawStatusMessages();
+        }
+        if (overlay.typing) {
+            move(LINES - 2, std::min<int>(overlay.prompt.size() + overlay.answer.size(), COLS - 1)); // Where the answer goes.
+        } else {
             move(cursorY - viewY, cursorX - viewX); // Adjust cursor position based on scroll
-            refresh(); // Refresh the screen after updates
+        }
+        refresh(); // Refresh the screen after updates
+    }
+
+    void drawEditor(std::string &filename) {
+        //int viewX = 0, viewY = 0; // Tracks the visible area (scroll position)
+        while (running) {
+            cursorY = std::min(cursorY, (int)content.size() -1);
+            cursorX = std::min(cursorX, (int)content[cursorY].size());
+            // Keys typed while the last frame was drawn are all handled before the next one.
+            if (!keyInput.pending()) {
+                drawFrame(filename);
+            }
             int height,width;
             int visiblewidth = COLS -1;
             int effective_screen_width = COLS - 1;
 
             int maxX = std::max(0, (int)content[cursorY].size() - visiblewidth); // Correct maxX            getmaxyx(stdscr, height,width);
-            int ch = getch(); // Get user input
+            int ch;
+            while (true) {
+                ch = readKey(0); // Get user input
+                // While a prompt is open the text is left alone, what arrives meanwhile
+                // waits until it is answered. Everything else carries on.
+                bool prompting = !modal.done();
+                if (ch == ERR) {
+                    armTimers();
+                    bool moreToTake = !prompting && (streamReader.hasMore() || clipboardReader.hasMore() ||
+                                                     (diskEventSeen && !saveRunning));
+                    events.wait(moreToTake ? 0 : -1); // Sleeps until there is something to do.
+                    ch = readKey(0);
+                }
+                bool changed = checkSave();
+                changed |= checkExternalChange(filename);
+                if (!prompting) {
+                    changed |= runAutosave(filename);
+                    changed |= readStream(filename);
+                    changed |= readClipboard();
+                }
+                changed |= status.expire();
+                changed |= runCompletions();
+                if (clockShown && ch == ERR) {
+                    changed = true; // Woken for the next second, most likely.
+                }
+                if (ch != ERR || changed) break; // Only draw again when something happened.
+            }
+            if (ch == ERR) {
+                continue; // No key, just redraw the status bar.
+            }
+            if (ch == KEY_RESIZE) { // readKey has resized ncurses already.
+                if (cursorY >= viewY + LINES - 1)
+                    viewY = std::max(0, cursorY - (LINES - 2));
+                if (cursorX >= viewX + COLS - 1)
+                    viewX = std::max(0, cursorX - (COLS - 2));
+                continue; // The next frame rewrites every row, no clear() and its blank flash needed.
+            }
+            clockShown = false;
+            if (!modal.done()) {
+                giveKeyToModal(ch); // A prompt is open, the key is its answer.
+                continue;
+            }
                         //The user does the konami code will be displayed a message.
             konamiSequence.push_back(ch);
             if (konamiSequence.size() > 10) {
@@ -886,48 +5978,47 @@ void printFile(const std::string &filename) {
                 konamiSequence.clear();
                 drawMessage("You just did the Konami code, that's awesome. :)");
             }
+            if (ch == 24 && clipboardReader.running()) { // Ctrl+X stops a paste that is taking long.
+                cancelClipboardPaste();
+                continue;
+            }
+            // Ctrl+Home and Ctrl+End have no fixed key codes, ncurses makes them up.
+            if (ch == ctrlHomeKey || ch == ctrlEndKey) {
+                bool home = ch == ctrlHomeKey;
+                cursorY = home ? 0 : content.size() - 1;
+                cursorX = home ? 0 : content[cursorY].size();
+                viewX = 0;
+                goalColumn = -1;
+                showCursor();
+                continue;
+            }
+            // Up and down remember the column they started from, anything else forgets it.
+            if (ch != KEY_UP && ch != KEY_DOWN && ch != KEY_PPAGE && ch != KEY_NPAGE) {
+                goalColumn = -1;
+            }
             switch (ch) {
-                case KEY_RESIZE: //This should fix the resize -z bug from before...
-                resizeterm(0, 0);
-                if (cursorY >= viewY + LINES - 1)
-                    viewY = std::max(0, cursorY - (LINES - 2));
-                if (cursorX >= viewX + COLS - 1)
-                    viewX = std::max(0, cursorX - (COLS - 2));
-                clear();  // Clear and redraw the screen
-                break;
-
                 case KEY_UP:
-                    if (cursorY > 0) {
-                        cursorY--;
-                        cursorX = 0;
-                        viewX = 0; // Reset viewX when moving up
-                        if (cursorY < viewY) viewY = cursorY; // Scroll up if needed
-                    }
+                    moveToLine(cursorY - 1);
                     break;
-                case KEY_PPAGE:
-                  if (cursorY > 0) {
-                        cursorY--;
-                        cursorX = 0;
-                        viewX = 0; // Reset viewX when moving up
-                        if (cursorY < viewY) viewY = cursorY; // Scroll up if needed
-                    }
+                case KEY_PPAGE: // A screen up, the view and the cursor together.
+                    viewY = std::max(0, viewY - pageHeight());
+                    moveToLine(cursorY - pageHeight());
                     break;
 
                 case KEY_DOWN:
-                    if (cursorY < content.size() - 1) {
-                        cursorY++;
-                        cursorX = 0;
-                        viewX = 0;
-                        if (cursorY >= viewY + LINES - 1) viewY = cursorY - LINES + 2; // Scroll down if needed.
-                    }
+                    moveToLine(cursorY + 1);
                     break;
-                case KEY_NPAGE:
-                   if (cursorY < content.size() - 1) {
-                        cursorY++;
-                        cursorX = 0;
-                        viewX = 0;
-                        if (cursorY >= viewY + LINES - 1) viewY = cursorY - LINES + 2; // Scroll down if needed                     
-                    }
+                case KEY_NPAGE: // A screen down.
+                    viewY = std::max(0, std::min(viewY + pageHeight(), (int)content.size() - pageHeight()));
+                    moveToLine(cursorY + pageHeight());
+                    break;
+                case KEY_HOME:
+                    cursorX = 0;
+                    viewX = 0;
+                    break;
+                case KEY_END:
+                    cursorX = content[cursorY].size();
+                    showCursor();
                     break;
                 case KEY_LEFT:
                     if (cursorX > 0) {
@@ -972,34 +6063,17 @@ void printFile(const std::string &filename) {
                     }
                     break;
                 case 6: //Ctrl + F
-                    find();
+                    startModal(find());
                     break;
-                case 20: // Ctrl + T
-                    timeout(0);
-                    while(true){
-                        std::string timeStr = getCurrentTime();
-                        attron(COLOR_PAIR(2));
-                        //mvprintw(LINES - 1, COLS - 10, "%s", timeStr.c_str());
-                        drawMessage("The time is: " +  getCurrentTime());
-                        attroff(COLOR_PAIR(2));
-                        refresh();
-                        napms(1000); // Wait 1 second before updating time        
-
-                    
-                        if (getch() !=ERR){
-                            break;
-                        }
-                    }
-                    timeout(-1);
+                case 20: // Ctrl + T - The time, ticking until the next key.
+                    clockShown = true;
                     break;
 
                 case '\n': // Enter key
                     pushUndo();
-                    content.insert(content.begin() + cursorY + 1, content[cursorY].substr(cursorX));
-                    content[cursorY] = content[cursorY].substr(0, cursorX);
+                    splitLine(cursorY, cursorX);
                     cursorY++;
                     cursorX = 0;
-                    isModified = true;
                     viewX = 0; // Reset viewX after inserting a new line
                     if (cursorY >= viewY + LINES - 1) viewY++; // Scroll down if needed
                     break;
@@ -1010,9 +6084,8 @@ void printFile(const std::string &filename) {
 
 
                 if (cursorX > 0) {
-                    content[cursorY].erase(cursorX - 1, 1);
+                    eraseText(cursorY, cursorX - 1, 1);
                     cursorX--; 
-                    isModified = true;
                     if ((int)content[cursorY].length() <= effective_screen_width) {
                         viewX = 0;
                     }
@@ -1034,10 +6107,8 @@ void printFile(const std::string &filename) {
                     cursorX = content[cursorY - 1].length();
 
                     
-                    content[cursorY - 1] += content[cursorY];
-                    content.erase(content.begin() + cursorY);
+                    joinLines(cursorY - 1);
                     cursorY--; // Move cursor up to the merged line
-                    isModified = true;
 
                     if (cursorX >= viewX + effective_screen_width) {
                         viewX = cursorX - (effective_screen_width - 1);
@@ -1046,34 +6117,27 @@ void printFile(const std::string &filename) {
                 }
                 break;
                 case 24: // Ctrl+X (Exit)
-                if (isModified){   
-                    attron(COLOR_PAIR(2));
-                    mvprintw(LINES - 2, 0, "Warning: Are you sure you want to leave without saving? (Y/N)");
-                    clrtoeol();
-                    attroff(COLOR_PAIR(2));
-                    refresh();
-
-                    int answer = getch();
-                    if (answer == 'Y' || answer == 'y') {
-                        running = false;
-                    }
-                } else {
-                    running = false;
-                }
-
+                    startModal(leaveEditor());
                     break;
                 case 19: // Ctrl+S (Save)
+                    if (isPartlyRead(filename)) {
+                        startModal(saveUnderNewName(filename));
+                        break;
+                    }
+                    if (changedOnDisk) {
+                        startModal(saveOverChange(filename));
+                        break;
+                    }
                     saveFile(filename);
                     //drawMessage("File has been saved! :)");
                     break;
                 case '\t': // Allow the tab key to work correctly. 
                     pushUndo();
-                    content[cursorY].insert(cursorX, "    ");
+                    insertText(cursorY, cursorX, "    ");
                     cursorX += 4;
-                    isModified = true;
                     break;
                 case 18: // Ctrl+R (Rename)
-                    renameFile(filename);
+                    startModal(renameFile(filename));
                     break;
                 case 26: // Ctrl + Z Undo
                     undo();
@@ -1082,232 +6146,44 @@ void printFile(const std::string &filename) {
                     redo();
                     break;
                 case 8: // Ctrl+H (Help)
-                    drawHelp();
+                    startModal(showHelp());
                     break;
                 case 11: // Control K
-                    Replace();
-                    break;
-                //The case 22 will be ctrl V that will allow for pasting text into the application.
-                case 22: { // Ctrl+V - Paste text from clipboard using xclip
-                    pushUndo();
-                    FILE *clipboard = popen("xclip -o -selection clipboard", "r");
-                    if (clipboard) {
-                        char buffer[256];
-                        std::string clipboardText;
-                        // Read all clipboard data
-                        while (fgets(buffer, sizeof(buffer), clipboard)) {
-                            clipboardText += buffer;
-                        }
-                        pclose(clipboard);
-                        
-                        if (clipboardText.empty()) {
-                            drawMessage("Clipboard is empty or no owner for the clipboard selection.");
-                            break;
-                        }
-                        isModified = true;
-                        
-                        // Split clipboardText into lines
-                        std::istringstream iss(clipboardText);
-                        std::string line;
-                        std::vector<std::string> lines;
-                        while (std::getline(iss, line)) {
-                            lines.push_back(line);
-                        }
-                        
-                        // Insert the first line at the current cursor position
-                        std::string beforeCursor = content[cursorY].substr(0, cursorX);
-                        std::string afterCursor = content[cursorY].substr(cursorX);
-                        content[cursorY] = beforeCursor + lines[0];
-                        
-                        // Insert any subsequent lines as new lines in the editor
-                        for (size_t i = 1; i < lines.size(); ++i) {
-                            content.insert(content.begin() + cursorY + i, lines[i]);
-                        }
-                        
-                        // Append the remaining part of the original line to the end of the last pasted line
-                        content[cursorY + lines.size() - 1] += afterCursor;
-                        
-                        // Update the cursor position to the end of the pasted text
-                        //cursorX = lines.back().size();
-                                // Update cursor position to the end of the pasted text
-                        cursorY = cursorY + lines.size() - 1;
-                        cursorX = content[cursorY].size() - afterCursor.size();
-                        
-                        // Adjust view to make sure cursor is visible
-                        if (cursorY < viewY) {
-                            viewY = cursorY; // Scroll up if needed
-                        } else if (cursorY >= viewY + LINES - 1) {
-                            viewY = cursorY - LINES + 2; // Scroll down if needed
-                        }
-                        
-                        if (cursorX < viewX) {
-                            viewX = cursorX; // Scroll left if needed
-                        } else if (cursorX >= viewX + COLS - 1) {
-                            viewX = cursorX - COLS + 2; // Scroll right if needed
-                        }
-                    } else {
-                        drawMessage("Error: Clipboard empty or could not be accessed.");
-                    }
-                    break;
-                }
-                case 15: 
-                drawMessage("Enter filename to open: ");
-                echo();
-                char newFilename[256];
-                getstr(newFilename);
-                noecho();
-
-                if (!isSafePath(newFilename)) {
-                    drawMessage("Error: Invalid file path! :(");
+                    startModal(Replace());
                     break;
-                }
-
-                // Check if file exists and is readable
-                if (!checkPermission(newFilename, EXISTS)) {
-                    drawMessage("Error: File doesn't exist! :(");
+                case 12: // Control + L = moving to another line.
+                    startModal(goToLine());
                     break;
-                }
-                if (!checkPermission(newFilename, READABLE)) {
-                    drawMessage("Error: No read permission! :(");
+                case 5: // Ctrl+E reload the file after another program changed it
+                    startModal(reloadFile(filename));
                     break;
-                }
-
-                // Save current file if modified
-                if (isModified) {
-                    drawMessage("Do you want to save the current file first? (Y/N): ");
-                    int answer = getch();
-                    if (answer == 'Y' || answer == 'y') {
-                        saveFile(filename);
+                //The case 22 will be ctrl V that will allow for pasting text into the application.
+                case 22: { // Ctrl+V - Paste the last copy made in NemoS
+                    if (clipboardReader.running()) {
+                        break; // Still waiting for the last one.
                     }
+                    paste(); // From the desktop it is pasted when it arrives.
+                    break;
                 }
-
-                // Load new file
-                filename = newFilename;
-                loadFile(filename);
-                cursorX = 0;
-                cursorY = 0;
-                viewX = 0;
-                viewY = 0;
-                break;
-            case 3: { // You Can Now Enable the copy mode.
-                if (!content.empty() && cursorY < content.size()) {
-                    int startY = cursorY, startX = cursorX;
-                    int endY = cursorY, endX = cursorX;
-                    bool selecting = true;
-
-                    drawMessage("Copy Mode: Use arrow keys to select, Ctrl+C to copy, Ctrl+X to cancel!");
-                    while (selecting) {
-                        // Redraw all visible lines with proper highlighting
-                        for (int i = 0; i < LINES - 1; i++) {
-                            int lineIdx = i + viewY;
-                            if (lineIdx < content.size()) {
-                                move(i, 0);
-                                clrtoeol();
-                                std::string line = content[lineIdx];
-                                
-                                // Determine if this line is in the selection
-                                bool isFirstLine = (lineIdx == std::min(startY, endY));
-                                bool isLastLine = (lineIdx == std::max(startY, endY));
-                                bool isMiddleLine = (lineIdx > std::min(startY, endY) && lineIdx < std::max(startY, endY));
-                                
-                                // Print the line with proper highlighting
-                                for (int j = 0; j < line.size(); j++) {
-                                    bool shouldHighlight = false;
-                                    
-                                    if (isMiddleLine) {
-                                        shouldHighlight = true;
-                                    } 
-                                    else if (isFirstLine && isLastLine) {
-                                        shouldHighlight = (j >= std::min(startX, endX) && j < std::max(startX, endX));
-                                    }
-                                    else if (isFirstLine) {
-                                        shouldHighlight = (startY < endY) ? (j >= startX) : (j >= endX);
-                                    }
-                                    else if (isLastLine) {
-                                        shouldHighlight = (startY < endY) ? (j < endX) : (j < startX);
-                                    }
-                                    
-                                    if (shouldHighlight) {
-                                        attron(COLOR_PAIR(4));
-                                        addch(line[j]);
-                                        attroff(COLOR_PAIR(4));
-                                    } else {
-                                        addch(line[j]);
-                                    }
-                                }
-                            }
-                        }
-                        
-                        move(endY - viewY, endX - viewX);
-                        refresh();
-                        
-                        int ch = getch();
-                        switch (ch) {
-                            case KEY_LEFT:
-                                if (endX > 0) endX--;
-                                break;
-                            case KEY_RIGHT:
-                                if (endX < content[endY].size()) endX++;
-                                break;
-                            case KEY_UP:
-                                if (endY > 0) {
-                                    endY--;
-                                    endX = std::min(endX, (int)content[endY].size());
-                                }
-                                break;
-                            case KEY_DOWN:
-                                if (endY < content.size() - 1) {
-                                    endY++;
-                                    endX = std::min(endX, (int)content[endY].size());
-                                }
-                                break;
-                            case 3: { // Ctrl+C to copy
-                                std::string selectedText;
-                                int firstY = std::min(startY, endY);
-                                int lastY = std::max(startY, endY);
-                                
-                                for (int y = firstY; y <= lastY; y++) {
-                                    if (y >= content.size()) break;
-                                    
-                                    int lineStart = (y == firstY) ? 
-                                        ((firstY == startY) ? startX : endX) : 0;
-                                    int lineEnd = (y == lastY) ? 
-                                        ((lastY == endY) ? endX : startX) : content[y].size();
-                                        
-                                    if (lineStart > lineEnd) std::swap(lineStart, lineEnd);
-                                    
-                                    if (lineStart < content[y].size()) {
-                                        selectedText += content[y].substr(lineStart, lineEnd - lineStart);
-                                    }
-                                    
-                                    if (y < lastY) selectedText += "\n";
-                                }
-                                
-                                FILE *clipboard = popen("xclip -i -selection clipboard", "w");
-                                if (clipboard) {
-                                    fputs(selectedText.c_str(), clipboard);
-                                    pclose(clipboard);
-                                    drawMessage("Selected text copied to clipboard! :)");
-                                }
-                                selecting = false;
-                                break;
-                            }
-                            case 24: // Ctrl+X to cancel
-                                selecting = false;
-                                break;
+                case 27: { // Alt+Y and Alt+V arrive as Escape then the letter.
+                    int next = readKey(50);
+                    if (next == 'y' || next == 'Y') {
+                        yankPop();
+                    } else if (next == 'v' || next == 'V') {
+                        if (!clipboardReader.running()) {
+                            pasteFromDesktop();
                         }
-                        
-                        // Update view to keep selection visible
-                        if (endY < viewY) viewY = endY;
-                        if (endY >= viewY + LINES - 1) viewY = endY - LINES + 2;
-                        if (endX < viewX) viewX = endX;
-                        if (endX >= viewX + COLS - 1) viewX = endX - COLS + 2;
+                    } else if (next != ERR) {
+                        unreadKey(next);
                     }
-                    cursorY = endY;
-                    cursorX = endX;
+                    break;
                 }
+                case 15: // Ctrl+O
+                    startModal(openFile(filename));
+                    break;
+            case 3: // You Can Now Enable the copy mode.
+                startModal(copyMode());
                 break;
-            }
 
                 
                 break;
@@ -1323,9 +6199,8 @@ void printFile(const std::string &filename) {
 
                 default:
                     pushUndo();
-                    content[cursorY].insert(cursorX, 1, ch);
+                    insertText(cursorY, cursorX, std::string(1, ch));
                     cursorX++;
-                    isModified = true;
 
                     // **Handle scrolling while typing**
                     if (cursorX >= viewX + COLS - 1) viewX++; // Scroll horizontally when typing beyond the view
@@ -1343,17 +6218,45 @@ void printFile(const std::string &filename) {
     }
 
 
+    // Puts a message on the line above the status bar without waiting for a
+    // key. It stays a few seconds, errors a bit longer, drawn with every frame.
     void drawMessage(const std::string &message) {
+        StatusMessages::Severity severity = message.compare(0, 5, "Error") == 0 ? StatusMessages::ERROR :
+                                            message.compare(0, 7, "Warning") == 0 ? StatusMessages::WARNING :
+                                            StatusMessages::INFO;
+        status.post(message, severity);
+        drawStatusMessages(); // Now too, for the loops that draw their own screen.
+        refresh();
+    }
+
+    void drawStatusMessages() {
+        StatusMessages::Severity severity;
+        std::string text = status.line(severity);
+        if (text.empty()) {
+            return;
+        }
+        move(LINES - 2, 0);
+        clrtoeol();
+        int colors = severity == StatusMessages::ERROR ? 5 : 2;
+        attron(COLOR_PAIR(colors));
+        mvprintw(LINES - 2, 0, "%s", text.substr(0, COLS - 1).c_str());
+        attroff(COLOR_PAIR(colors));
+    }
+
+    // A question on the message line, the cursor is left after it for the answer.
+    void drawPrompt(const std::string &prompt) {
+        move(LINES - 2, 0);
+        clrtoeol();
         attron(COLOR_PAIR(2));
-        mvprintw(LINES - 2, 0, "%s", message.c_str());
+        mvprintw(LINES - 2, 0, "%s", prompt.substr(0, COLS - 1).c_str());
         attroff(COLOR_PAIR(2));
         refresh();
-
-        getch(); // Wait for key press
     }
 };
 
 int main(int argc, char *argv[]) {
+    std::string filename;
+    bool follow = false;
     for (int i = 1; i < argc; ++i) {
         std::string arg = argv[i];
         if (arg == "--help") {
@@ -1363,6 +6266,27 @@ int main(int argc, char *argv[]) {
         else if (arg == "--delete"){ // Allow for a file to be deleted. :)
             return DeleteFile(argc, argv, i);
         }
+        else if (arg == "--bench-save"){ // Time how fast a large document is saved.
+            return BenchSave(argc, argv, i);
+        }
+        else if (arg == "--self-test-snapshots"){ // Check the snapshots under readers on every core.
+            return SelfTestSnapshots(argc, argv, i);
+        }
+        else if (arg == "--replace"){ // Replace text in many files at once without opening them.
+            return ReplaceInFiles(argc, argv, i);
+        }
+        else if (arg == "--view"){ // Page through a huge file without loading it.
+            if (i + 1 >= argc) {
+                std::cout << "Error: --view needs a file name :(\n";
+                return 1;
+            }
+            Pager pager;
+            return pager.run(argv[i + 1]);
+        }
+        else if (arg == "--follow"){ // Keep reading what gets added to a log file.
+            follow = true;
+            continue;
+        }
         else if (arg == "--version"){ // This will show the user what version of nemos they are using.
             std::cout << "nemos, version 4.0\n";
             return 0;
@@ -1374,20 +6298,32 @@ int main(int argc, char *argv[]) {
         }
         
         
-        else if (arg[0] == '-'){
+        else if (arg != "-" && arg[0] == '-'){ // - reads from stdin, handled below.
             std::cout << "Error: Invalid option: '" << arg << "' :(\n";
             helpCommand();
             return 1;
         }
+        else if (filename.empty()) {
+            filename = arg;
+        }
 
 
     }
-    std::string filename;
-    if (argc >= 2) {
-        filename = argv[1];
+
+    // cmd | nemos - (or just cmd | nemos): read the pipe, and the keyboard from the terminal.
+    int input = -1;
+    if (filename == "-" || (filename.empty() && !isatty(STDIN_FILENO))) {
+        input = dup(STDIN_FILENO);
+        if (input < 0 || !freopen("/dev/tty", "r", stdin)) {
+            std::cout << "Error: Could not open the terminal for the keyboard :(\n";
+            return 1;
+        }
+        filename.clear();
     }
 
     NemoS editor;
+    editor.setFollow(follow);
+    editor.setInput(input);
 
     editor.run(filename);
 